@@ -0,0 +1,163 @@
+(*
+ * Copyright 2003-2011 Savonet team
+ *
+ * This file is part of ocaml-opus.
+ *
+ * ocaml-opus is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocaml-opus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ocaml-opus; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *)
+
+(**
+  * Domain scaling harness: runs 1 to N domains, each encoding and decoding
+  * its own independent streams, and reports throughput per domain, frame
+  * latency and memory usage.
+  *)
+
+let domains = ref (Domain.recommended_domain_count ())
+let streams = ref 16
+let frames = ref 500
+let samplerate = 48000
+let channels = 2
+
+(* 20ms. *)
+let frame_size = samplerate / 50
+
+type stream = {
+  enc : Opus.Encoder.t;
+  enc_os : Ogg.Stream.stream;
+  dec : Opus.Decoder.t;
+  dec_os : Ogg.Stream.stream;
+}
+
+let create_stream () =
+  let enc_os = Ogg.Stream.create () in
+  let enc =
+    Opus.Encoder.create ~samplerate ~channels ~application:`Audio enc_os
+  in
+  let dec_os = Ogg.Stream.create ~serial:(Ogg.Stream.serialno enc_os) () in
+  let dec =
+    Opus.Decoder.create ~samplerate (Opus.Encoder.header enc)
+      (Opus.Encoder.comments enc)
+  in
+  { enc; enc_os; dec; dec_os }
+
+let close_stream s =
+  Opus.Encoder.close s.enc;
+  Opus.Decoder.close s.dec
+
+let run_frame s pcm out =
+  ignore (Opus.Encoder.encode_float_ba s.enc pcm 0 frame_size);
+  (try Ogg.Stream.put_page s.dec_os (Ogg.Stream.flush_page s.enc_os)
+   with Ogg.Not_enough_data -> ());
+  try ignore (Opus.Decoder.decode_float_ba s.dec s.dec_os out 0 frame_size)
+  with Ogg.Not_enough_data -> ()
+
+let make_pcm () =
+  Array.init channels (fun c ->
+      let b =
+        Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout frame_size
+      in
+      for i = 0 to frame_size - 1 do
+        let f = 440. *. float (c + 1) in
+        b.{i} <-
+          0.5 *. sin (2. *. Float.pi *. f *. float i /. float samplerate)
+      done;
+      b)
+
+(* Resident memory in kB, or 0 if not available. *)
+let rss () =
+  try
+    let ic = open_in "/proc/self/status" in
+    let rec find () =
+      let l = input_line ic in
+      if String.length l > 6 && String.sub l 0 6 = "VmRSS:" then
+        Scanf.sscanf (String.sub l 6 (String.length l - 6)) " %d" (fun n -> n)
+      else find ()
+    in
+    let ans = try find () with End_of_file | Scanf.Scan_failure _ -> 0 in
+    close_in ic;
+    ans
+  with Sys_error _ -> 0
+
+(* Returns elapsed time, per-frame latencies and memory usage while streams
+   are still open. *)
+let worker () =
+  let pcm = make_pcm () in
+  let out =
+    Array.init channels (fun _ ->
+        Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout frame_size)
+  in
+  let streams = Array.init !streams (fun _ -> create_stream ()) in
+  let n = Array.length streams in
+  let latencies = Array.make (!frames * n) 0. in
+  let start = Unix.gettimeofday () in
+  for f = 0 to !frames - 1 do
+    Array.iteri
+      (fun i s ->
+        let t = Unix.gettimeofday () in
+        run_frame s pcm out;
+        latencies.((f * n) + i) <- Unix.gettimeofday () -. t)
+      streams
+  done;
+  let elapsed = Unix.gettimeofday () -. start in
+  let rss = rss () in
+  Array.iter close_stream streams;
+  (elapsed, latencies, rss)
+
+let percentile a p =
+  let n = Array.length a in
+  a.(min (n - 1) (int_of_float (p *. float n)))
+
+let usage = "usage: scaling [options]"
+
+let () =
+  Arg.parse
+    [
+      ("--domains", Arg.Set_int domains, "Maximum number of domains");
+      ("--streams", Arg.Set_int streams, "Number of streams per domain");
+      ("--frames", Arg.Set_int frames, "Number of frames per stream");
+    ]
+    (fun _ ->
+      Printf.eprintf "Error: too many arguments\n";
+      exit 1)
+    usage;
+  Printf.printf "%d streams per domain, %d frames of %dms per stream.\n%!"
+    !streams !frames
+    (1000 * frame_size / samplerate);
+  Printf.printf "%8s %14s %10s %10s %10s %10s %12s\n%!" "domains"
+    "frames/s/dom" "scaling" "p50 (us)" "p99 (us)" "max (us)" "peak rss";
+  let base = ref 0. in
+  for d = 1 to !domains do
+    let workers = List.init d (fun _ -> Domain.spawn worker) in
+    let results = List.map Domain.join workers in
+    let rate =
+      List.fold_left
+        (fun r (elapsed, _, _) ->
+          r +. (float (!streams * !frames) /. elapsed))
+        0. results
+      /. float d
+    in
+    if d = 1 then base := rate;
+    let latencies = Array.concat (List.map (fun (_, l, _) -> l) results) in
+    let rss = List.fold_left (fun m (_, _, rss) -> max m rss) 0 results in
+    Array.sort compare latencies;
+    let us x = x *. 1_000_000. in
+    Printf.printf "%8d %14.0f %9.2fx %10.1f %10.1f %10.1f %12s\n%!" d rate
+      (rate /. !base)
+      (us (percentile latencies 0.5))
+      (us (percentile latencies 0.99))
+      (us latencies.(Array.length latencies - 1))
+      (if rss > 0 then Printf.sprintf "%d kB" rss else "n/a")
+  done
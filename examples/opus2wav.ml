@@ -26,6 +26,9 @@
 
 let src = ref ""
 let dst = ref ""
+let usage = "usage: opus2wav [options] source destination"
+let use_ba = ref false
+let use_file = ref false
 
 let output_int chan n =
   output_char chan (char_of_int ((n lsr 0) land 0xff));
@@ -37,26 +40,9 @@ let output_short chan n =
   output_char chan (char_of_int ((n lsr 0) land 0xff));
   output_char chan (char_of_int ((n lsr 8) land 0xff))
 
-let usage = "usage: opus2wav [options] source destination"
-let use_ba = ref false
-
-let () =
-  Arg.parse
-    [("-ba", Arg.Set use_ba, "Use big arrays")]
-    (let pnum = ref (-1) in
-     fun s ->
-       incr pnum;
-       match !pnum with
-         | 0 -> src := s
-         | 1 -> dst := s
-         | _ ->
-             Printf.eprintf "Error: too many arguments\n";
-             exit 1)
-    usage;
-  if !src = "" || !dst = "" then (
-    Printf.printf "%s\n" usage;
-    exit 1);
+let samplerate = 48000
 
+let decode_ogg () =
   let sync, fd = Ogg.Sync.create_from_file !src in
   Printf.printf "Checking file.\n%!";
   let os, p1 =
@@ -74,7 +60,6 @@ let () =
   let page = Ogg.Sync.read sync in
   Ogg.Stream.put_page os page;
   let p2 = Ogg.Stream.get_packet os in
-  let samplerate = 48000 in
   Printf.printf "Creating decoder...\n%!";
   let dec = Opus.Decoder.create ~samplerate p1 p2 in
   let chans = Opus.Decoder.channels dec in
@@ -120,7 +105,44 @@ let () =
    with Ogg.End_of_stream -> ());
   Printf.printf "done.\n%!";
   Unix.close fd;
+  outbuf
+
+(* Decode with [Opus.File], mixing all the chained streams to stereo. *)
+let decode_file () =
+  Printf.printf "Decoding...%!";
+  let f = Opus.File.openfile ~samplerate !src in
+  let chans = 2 in
+  let buflen = 960 * 6 in
+  let outbuf = Array.make chans ([||] : float array) in
+  let decode () =
+    if !use_ba then (
+      let buf =
+        Array.init chans (fun _ ->
+            Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout buflen)
+      in
+      let len = Opus.File.decode_float_ba f buf 0 buflen in
+      for c = 0 to chans - 1 do
+        let pcm = Array.init len (fun i -> buf.(c).{i}) in
+        outbuf.(c) <- Array.append outbuf.(c) pcm
+      done)
+    else (
+      let buf = Array.init chans (fun _ -> Array.make buflen 0.) in
+      let len = Opus.File.decode_float f buf 0 buflen in
+      for c = 0 to chans - 1 do
+        outbuf.(c) <- Array.append outbuf.(c) (Array.sub buf.(c) 0 len)
+      done)
+  in
+  (try
+     while true do
+       decode ()
+     done
+   with Ogg.End_of_stream -> ());
+  Printf.printf "done.\n%!";
+  Opus.File.close f;
+  outbuf
 
+let write_wav outbuf =
+  let chans = Array.length outbuf in
   let len = Array.length outbuf.(0) in
   let datalen = 2 * len in
   let oc = open_out_bin !dst in
@@ -151,5 +173,27 @@ let () =
       output_short oc x
     done
   done;
-  close_out oc;
+  close_out oc
+
+let () =
+  Arg.parse
+    [
+      ("-ba", Arg.Set use_ba, "Use big arrays");
+      ("-file", Arg.Set use_file, "Use the file reader");
+    ]
+    (let pnum = ref (-1) in
+     fun s ->
+       incr pnum;
+       match !pnum with
+         | 0 -> src := s
+         | 1 -> dst := s
+         | _ ->
+             Printf.eprintf "Error: too many arguments\n";
+             exit 1)
+    usage;
+  if !src = "" || !dst = "" then (
+    Printf.printf "%s\n" usage;
+    exit 1);
+  let outbuf = if !use_file then decode_file () else decode_ogg () in
+  write_wav outbuf;
   Gc.full_major ()
@@ -175,7 +175,15 @@ let _ =
       done
     with End_of_file -> ()
   end;
-  Encoder.eos enc;
+  let rem = !rem in
+  let len = Array.length rem.(0) in
+  if !use_ba then
+    Encoder.flush_ba enc
+      (Array.map
+         (Bigarray.Array1.of_array Bigarray.float32 Bigarray.c_layout)
+         rem)
+      0 len
+  else Encoder.flush enc rem 0 len;
   begin
     try
       while true do
@@ -18,5 +18,10 @@ let () =
                 | None -> default
                 | Some deps -> deps)
       in
+      (* Used by vectored encoding and decoding. *)
+      let libs =
+        if C.ocaml_config_var c "os_type" = Some "Win32" then conf.libs
+        else conf.libs @ ["-lpthread"]
+      in
       C.Flags.write_sexp "c_flags.sexp" conf.cflags;
-      C.Flags.write_sexp "c_library_flags.sexp" conf.libs)
+      C.Flags.write_sexp "c_library_flags.sexp" libs)
@@ -5,13 +5,31 @@ exception Unimplemented
 exception Invalid_state
 exception Alloc_fail
 
+external init : unit -> unit = "ocaml_opus_init"
+
 let () =
   Callback.register_exception "opus_exn_buffer_too_small" Buffer_too_small;
   Callback.register_exception "opus_exn_internal_error" Internal_error;
   Callback.register_exception "opus_exn_invalid_packet" Invalid_packet;
   Callback.register_exception "opus_exn_unimplemented" Unimplemented;
   Callback.register_exception "opus_exn_invalid_state" Invalid_state;
-  Callback.register_exception "opus_exn_alloc_fail" Alloc_fail
+  Callback.register_exception "opus_exn_alloc_fail" Alloc_fail;
+  init ()
+
+(* Error codes from opus_defines.h, as returned by the typed control
+   externals. *)
+let check ret =
+  if ret < 0 then (
+    match ret with
+      | -1 -> invalid_arg "opus"
+      | -2 -> raise Buffer_too_small
+      | -3 -> raise Internal_error
+      | -4 -> raise Invalid_packet
+      | -5 -> raise Unimplemented
+      | -6 -> raise Invalid_state
+      | -7 -> raise Alloc_fail
+      | _ -> failwith "Unknown opus error")
+[@@inline]
 
 let recommended_frame_size = 960 * 6
 
@@ -33,6 +51,94 @@ type generic_control =
   | `Get_lsb_depth of int ref
   | `Set_phase_inversion_disabled of bool ]
 
+(* Constants from opus_defines.h. *)
+let opus_auto = -1000
+let opus_bitrate_max = -1
+
+let int_of_bandwidth = function
+  | `Auto -> opus_auto
+  | `Narrow_band -> 1101
+  | `Medium_band -> 1102
+  | `Wide_band -> 1103
+  | `Super_wide_band -> 1104
+  | `Full_band -> 1105
+
+let max_bandwidth_of_int = function
+  | 1101 -> `Narrow_band
+  | 1102 -> `Medium_band
+  | 1103 -> `Wide_band
+  | 1104 -> `Super_wide_band
+  | 1105 -> `Full_band
+  | _ -> failwith "Unknown opus error"
+
+let bandwidth_of_int = function
+  | n when n = opus_auto -> `Auto
+  | n -> (max_bandwidth_of_int n :> bandwidth)
+
+let split_comments (vendor, comments) =
+  let comments =
+    Array.map
+      (fun s ->
+        let n = String.index s '=' in
+        (String.sub s 0 n, String.sub s (n + 1) (String.length s - n - 1)))
+      comments
+  in
+  let comments = Array.to_list comments in
+  (vendor, comments)
+
+module Loudness = struct
+  type t = {
+    integrated : float;
+    range : float;
+    true_peak : float;
+    sample_peak : float;
+  }
+
+  let r128_gain ?(target = -23.) t =
+    if t.integrated = neg_infinity then 0
+    else (
+      let gain =
+        Float.to_int (Float.round ((target -. t.integrated) *. 256.))
+      in
+      max (-32768) (min 32767 gain))
+
+  let replaygain ?(reference = -18.) t =
+    if t.integrated = neg_infinity then 0. else reference -. t.integrated
+
+  let replaygain_tags ?reference t =
+    [
+      ( "REPLAYGAIN_TRACK_GAIN",
+        Printf.sprintf "%.2f dB" (replaygain ?reference t) );
+      ( "REPLAYGAIN_TRACK_PEAK",
+        Printf.sprintf "%.6f" (10. ** (t.true_peak /. 20.)) );
+    ]
+
+  external header_gain : Ogg.Stream.packet -> int = "ocaml_opus_header_gain"
+
+  external set_header_gain : Ogg.Stream.packet -> int -> Ogg.Stream.packet
+    = "ocaml_opus_header_set_gain"
+
+  external comments : Ogg.Stream.packet -> string * string array
+    = "ocaml_opus_comments"
+
+  external comments_packet : string -> string array -> Ogg.Stream.packet
+    = "ocaml_opus_comments_packet"
+
+  let set_tags p tags =
+    let vendor, comments = split_comments (comments p) in
+    let replaced (k, _) =
+      List.exists
+        (fun (k', _) -> String.uppercase_ascii k = String.uppercase_ascii k')
+        tags
+    in
+    let comments = List.filter (fun c -> not (replaced c)) comments @ tags in
+    comments_packet vendor
+      (Array.of_list (List.map (fun (k, v) -> k ^ "=" ^ v) comments))
+
+  let set_track_gain p gain =
+    set_tags p [("R128_TRACK_GAIN", string_of_int gain)]
+end
+
 module Decoder = struct
   type control = [ generic_control | `Set_gain of int | `Get_gain of int ref ]
 
@@ -44,17 +150,7 @@ module Decoder = struct
   external comments : Ogg.Stream.packet -> string * string array
     = "ocaml_opus_comments"
 
-  let comments p =
-    let vendor, comments = comments p in
-    let comments =
-      Array.map
-        (fun s ->
-          let n = String.index s '=' in
-          (String.sub s 0 n, String.sub s (n + 1) (String.length s - n - 1)))
-        comments
-    in
-    let comments = Array.to_list comments in
-    (vendor, comments)
+  let comments p = split_comments (comments p)
 
   type decoder
 
@@ -64,17 +160,112 @@ module Decoder = struct
     decoder : decoder;
   }
 
-  external create : samplerate:int -> channels:int -> decoder
+  external pre_skip : Ogg.Stream.packet -> int = "ocaml_opus_header_pre_skip"
+  external gain : Ogg.Stream.packet -> int = "ocaml_opus_header_gain"
+
+  external create : samplerate:int -> channels:int -> pre_skip:int -> decoder
     = "ocaml_opus_decoder_create"
 
-  let create ?(samplerate = 48000) p1 p2 =
-    if not (check_packet p1) then raise Invalid_packet;
-    let decoder = create ~samplerate ~channels:(channels p1) in
-    { header = p1; comments = p2; decoder }
+  external close : decoder -> unit = "ocaml_opus_decoder_close"
+
+  let close t = close t.decoder
+
+  external reset_state : decoder -> int = "ocaml_opus_decoder_reset_state"
+    [@@noalloc]
+
+  external get_final_range : decoder -> int
+    = "ocaml_opus_decoder_get_final_range"
+
+  external get_pitch : decoder -> int = "ocaml_opus_decoder_get_pitch"
+  external get_bandwidth : decoder -> int = "ocaml_opus_decoder_get_bandwidth"
+
+  external set_lsb_depth : decoder -> int -> int
+    = "ocaml_opus_decoder_set_lsb_depth"
+    [@@noalloc]
+
+  external get_lsb_depth : decoder -> int = "ocaml_opus_decoder_get_lsb_depth"
+
+  external set_phase_inversion_disabled : decoder -> bool -> int
+    = "ocaml_opus_decoder_set_phase_inversion_disabled"
+    [@@noalloc]
+
+  external set_gain : decoder -> int -> int = "ocaml_opus_decoder_set_gain"
+    [@@noalloc]
+
+  external get_gain : decoder -> int = "ocaml_opus_decoder_get_gain"
+
+  external set_complexity : decoder -> int -> int
+    = "ocaml_opus_decoder_set_complexity"
+    [@@noalloc]
+
+  external set_timing : decoder -> bool -> unit = "ocaml_opus_decoder_set_timing"
+    [@@noalloc]
+
+  external collect_timing : decoder -> int array -> int
+    = "ocaml_opus_decoder_collect_timing"
+    [@@noalloc]
+
+  external request_complexity : decoder -> int -> int
+    = "ocaml_opus_decoder_request_complexity"
+    [@@noalloc]
 
-  external apply_control : control -> decoder -> unit = "ocaml_opus_decoder_ctl"
+  let reset_state t = check (reset_state t.decoder)
+  let get_final_range t = get_final_range t.decoder
+  let get_pitch t = get_pitch t.decoder
+  let get_bandwidth t = bandwidth_of_int (get_bandwidth t.decoder)
+  let set_lsb_depth t n = check (set_lsb_depth t.decoder n)
+  let get_lsb_depth t = get_lsb_depth t.decoder
 
-  let apply_control control t = apply_control control t.decoder
+  let set_phase_inversion_disabled t b =
+    check (set_phase_inversion_disabled t.decoder b)
+
+  let set_gain t n = check (set_gain t.decoder n)
+  let get_gain t = get_gain t.decoder
+  let set_complexity t n = check (set_complexity t.decoder n)
+
+  external enable_loudness : decoder -> unit
+    = "ocaml_opus_decoder_enable_loudness"
+
+  external loudness : decoder -> Loudness.t = "ocaml_opus_decoder_loudness"
+
+  let enable_loudness t = enable_loudness t.decoder
+  let loudness t = loudness t.decoder
+  let set_timing t b = set_timing t.decoder b
+  let collect_timing t hist = collect_timing t.decoder hist
+  let request_complexity t n = check (request_complexity t.decoder n)
+
+  external set_mix : decoder -> float array array -> unit
+    = "ocaml_opus_decoder_set_mix"
+
+  external decoded_channels : decoder -> int
+    = "ocaml_opus_decoder_decoded_channels"
+    [@@noalloc]
+
+  let set_mix t matrix = set_mix t.decoder matrix
+  let reset_mix t = set_mix t [||]
+  let decoded_channels t = decoded_channels t.decoder
+
+  let create ?(samplerate = 48000) ?channels:decoded p1 p2 =
+    if not (check_packet p1) then raise Invalid_packet;
+    (* Pre-skip is expressed at 48kHz. *)
+    let pre_skip = pre_skip p1 * samplerate / 48000 in
+    let channels = match decoded with Some n -> n | None -> channels p1 in
+    let decoder = create ~samplerate ~channels ~pre_skip in
+    let t = { header = p1; comments = p2; decoder } in
+    set_gain t (gain p1);
+    t
+
+  let apply_control control t =
+    match control with
+      | `Reset_state -> reset_state t
+      | `Get_final_range r -> r := get_final_range t
+      | `Get_pitch r -> r := get_pitch t
+      | `Get_bandwidth r -> r := get_bandwidth t
+      | `Set_lsb_depth n -> set_lsb_depth t n
+      | `Get_lsb_depth r -> r := get_lsb_depth t
+      | `Set_phase_inversion_disabled b -> set_phase_inversion_disabled t b
+      | `Set_gain n -> set_gain t n
+      | `Get_gain r -> r := get_gain t
 
   external decode_float :
     decoder ->
@@ -103,8 +294,28 @@ module Decoder = struct
   let decode_float_ba ?(decode_fec = false) t os buf ofs len =
     decode_float_ba t.decoder os buf ofs len decode_fec
 
+  external decode_many :
+    decoder array ->
+    bool ->
+    int ->
+    (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    int array ->
+    int array ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    int array ->
+    int array ->
+    int array
+    = "ocaml_opus_decoder_decode_many_byte" "ocaml_opus_decoder_decode_many"
+
+  let decode_many ?(decode_fec = false) ?(threads = 1) decoders ~data ~data_ofs
+      ~data_len ~pcm ~pcm_ofs ~pcm_len =
+    decode_many
+      (Array.map (fun t -> t.decoder) decoders)
+      decode_fec threads data data_ofs data_len pcm pcm_ofs pcm_len
+
   let comments t = comments t.comments
   let channels t = channels t.header
+  let pre_skip t = pre_skip t.header
 end
 
 module Encoder = struct
@@ -125,14 +336,15 @@ module Encoder = struct
     | `Set_force_channels of bool
     | `Get_force_channels of bool ref
     | `Set_max_bandwidth of max_bandwidth
-    | `Get_max_bandwidth of max_bandwidth
+    | `Get_max_bandwidth of max_bandwidth ref
     | `Set_bandwidth of bandwidth
     | `Set_signal of signal
     | `Get_signal of signal ref
     | `Set_application of application
-    | `Get_application of application
-    | `Get_samplerate of int
-    | `Get_lookhead of int
+    | `Get_application of application ref
+    | `Get_samplerate of int ref
+    | `Get_lookahead of int ref
+    | `Get_lookhead of int ref
     | `Set_inband_fec of bool
     | `Get_inband_fec of bool ref
     | `Set_packet_loss_perc of int
@@ -151,7 +363,7 @@ module Encoder = struct
   }
 
   external create :
-    pre_skip:int ->
+    pre_skip:int option ->
     comments:string array ->
     gain:int ->
     samplerate:int ->
@@ -160,7 +372,7 @@ module Encoder = struct
     encoder * Ogg.Stream.packet * Ogg.Stream.packet
     = "ocaml_opus_encoder_create_byte" "ocaml_opus_encoder_create"
 
-  let create ?(pre_skip = 3840) ?(comments = []) ?(gain = 0) ~samplerate
+  let create ?pre_skip ?(comments = []) ?(gain = 0) ~samplerate
       ~channels ~application os =
     let comments =
       List.map
@@ -176,9 +388,264 @@ module Encoder = struct
   let header enc = enc.header
   let comments enc = enc.comments
 
-  external apply_control : control -> encoder -> unit = "ocaml_opus_encoder_ctl"
+  external close : encoder -> unit = "ocaml_opus_encoder_close"
+
+  let close t = close t.enc
+
+  external pre_skip : encoder -> int = "ocaml_opus_encoder_pre_skip"
+    [@@noalloc]
+
+  let pre_skip t = pre_skip t.enc
+
+  (* Constants from opus_defines.h. *)
+  let int_of_application = function
+    | `Voip -> 2048
+    | `Audio -> 2049
+    | `Restricted_lowdelay -> 2051
+
+  let application_of_int = function
+    | 2048 -> `Voip
+    | 2049 -> `Audio
+    | 2051 -> `Restricted_lowdelay
+    | _ -> failwith "Unknown opus error"
+
+  let int_of_signal = function
+    | `Auto -> opus_auto
+    | `Voice -> 3001
+    | `Music -> 3002
+
+  let signal_of_int = function
+    | 3001 -> `Voice
+    | 3002 -> `Music
+    | n when n = opus_auto -> `Auto
+    | _ -> failwith "Unknown opus error"
+
+  let int_of_bitrate = function
+    | `Auto -> opus_auto
+    | `Bitrate_max -> opus_bitrate_max
+    | `Bitrate n -> n
+
+  let bitrate_of_int = function
+    | n when n = opus_auto -> `Auto
+    | n when n = opus_bitrate_max -> `Bitrate_max
+    | n -> `Bitrate n
+
+  external reset_state : encoder -> int = "ocaml_opus_encoder_reset_state"
+    [@@noalloc]
+
+  external get_final_range : encoder -> int
+    = "ocaml_opus_encoder_get_final_range"
+
+  external get_pitch : encoder -> int = "ocaml_opus_encoder_get_pitch"
+  external get_bandwidth : encoder -> int = "ocaml_opus_encoder_get_bandwidth"
+
+  external set_lsb_depth : encoder -> int -> int
+    = "ocaml_opus_encoder_set_lsb_depth"
+    [@@noalloc]
+
+  external get_lsb_depth : encoder -> int = "ocaml_opus_encoder_get_lsb_depth"
+
+  external set_phase_inversion_disabled : encoder -> bool -> int
+    = "ocaml_opus_encoder_set_phase_inversion_disabled"
+    [@@noalloc]
+
+  external set_complexity : encoder -> int -> int
+    = "ocaml_opus_encoder_set_complexity"
+    [@@noalloc]
+
+  external get_complexity : encoder -> int
+    = "ocaml_opus_encoder_get_complexity"
+
+  external set_bitrate : encoder -> int -> int = "ocaml_opus_encoder_set_bitrate"
+    [@@noalloc]
+
+  external get_bitrate : encoder -> int = "ocaml_opus_encoder_get_bitrate"
+
+  external requested_bitrate : encoder -> int
+    = "ocaml_opus_encoder_requested_bitrate"
+    [@@noalloc]
+
+  external set_vbr : encoder -> bool -> int = "ocaml_opus_encoder_set_vbr"
+    [@@noalloc]
+
+  external get_vbr : encoder -> bool = "ocaml_opus_encoder_get_vbr"
+
+  external set_vbr_constraint : encoder -> bool -> int
+    = "ocaml_opus_encoder_set_vbr_constraint"
+    [@@noalloc]
+
+  external get_vbr_constraint : encoder -> bool
+    = "ocaml_opus_encoder_get_vbr_constraint"
+
+  external set_force_channels : encoder -> int -> int
+    = "ocaml_opus_encoder_set_force_channels"
+    [@@noalloc]
+
+  external get_force_channels : encoder -> int
+    = "ocaml_opus_encoder_get_force_channels"
+
+  external set_max_bandwidth : encoder -> int -> int
+    = "ocaml_opus_encoder_set_max_bandwidth"
+    [@@noalloc]
+
+  external get_max_bandwidth : encoder -> int
+    = "ocaml_opus_encoder_get_max_bandwidth"
+
+  external set_bandwidth : encoder -> int -> int
+    = "ocaml_opus_encoder_set_bandwidth"
+    [@@noalloc]
+
+  external set_signal : encoder -> int -> int = "ocaml_opus_encoder_set_signal"
+    [@@noalloc]
+
+  external get_signal : encoder -> int = "ocaml_opus_encoder_get_signal"
+
+  external set_application : encoder -> int -> int
+    = "ocaml_opus_encoder_set_application"
+    [@@noalloc]
+
+  external get_application : encoder -> int
+    = "ocaml_opus_encoder_get_application"
+
+  external get_samplerate : encoder -> int
+    = "ocaml_opus_encoder_get_samplerate"
+
+  external get_lookahead : encoder -> int = "ocaml_opus_encoder_get_lookahead"
+
+  external set_inband_fec : encoder -> bool -> int
+    = "ocaml_opus_encoder_set_inband_fec"
+    [@@noalloc]
+
+  external get_inband_fec : encoder -> bool
+    = "ocaml_opus_encoder_get_inband_fec"
+
+  external set_packet_loss_perc : encoder -> int -> int
+    = "ocaml_opus_encoder_set_packet_loss_perc"
+    [@@noalloc]
+
+  external get_packet_loss_perc : encoder -> int
+    = "ocaml_opus_encoder_get_packet_loss_perc"
+
+  external set_dtx : encoder -> bool -> int = "ocaml_opus_encoder_set_dtx"
+    [@@noalloc]
+
+  external get_dtx : encoder -> bool = "ocaml_opus_encoder_get_dtx"
+
+  let reset_state t = check (reset_state t.enc)
+  let get_final_range t = get_final_range t.enc
+  let get_pitch t = get_pitch t.enc
+  let get_bandwidth t = bandwidth_of_int (get_bandwidth t.enc)
+  let set_lsb_depth t n = check (set_lsb_depth t.enc n)
+  let get_lsb_depth t = get_lsb_depth t.enc
+
+  let set_phase_inversion_disabled t b =
+    check (set_phase_inversion_disabled t.enc b)
+
+  let set_complexity t n = check (set_complexity t.enc n)
+  let get_complexity t = get_complexity t.enc
+  let set_bitrate t n = check (set_bitrate t.enc n)
+  let get_bitrate t = get_bitrate t.enc
+  let set_vbr t b = check (set_vbr t.enc b)
+  let get_vbr t = get_vbr t.enc
+  let set_vbr_constraint t b = check (set_vbr_constraint t.enc b)
+  let get_vbr_constraint t = get_vbr_constraint t.enc
+
+  let set_max_bandwidth t b =
+    check (set_max_bandwidth t.enc (int_of_bandwidth b))
+
+  let get_max_bandwidth t = max_bandwidth_of_int (get_max_bandwidth t.enc)
+  let set_bandwidth t b = check (set_bandwidth t.enc (int_of_bandwidth b))
+  let set_signal t s = check (set_signal t.enc (int_of_signal s))
+  let get_signal t = signal_of_int (get_signal t.enc)
+  let set_application t a = check (set_application t.enc (int_of_application a))
+  let get_application t = application_of_int (get_application t.enc)
+  let get_samplerate t = get_samplerate t.enc
+  let get_lookahead t = get_lookahead t.enc
+  let set_inband_fec t b = check (set_inband_fec t.enc b)
+  let get_inband_fec t = get_inband_fec t.enc
+  let set_packet_loss_perc t n = check (set_packet_loss_perc t.enc n)
+  let get_packet_loss_perc t = get_packet_loss_perc t.enc
+  let set_dtx t b = check (set_dtx t.enc b)
+  let get_dtx t = get_dtx t.enc
+
+  external set_timing : encoder -> bool -> unit = "ocaml_opus_encoder_set_timing"
+    [@@noalloc]
+
+  external collect_timing : encoder -> int array -> int
+    = "ocaml_opus_encoder_collect_timing"
+    [@@noalloc]
+
+  external request_complexity : encoder -> int -> int
+    = "ocaml_opus_encoder_request_complexity"
+    [@@noalloc]
+
+  let set_timing t b = set_timing t.enc b
+
+  external enable_loudness : encoder -> unit
+    = "ocaml_opus_encoder_enable_loudness"
+
+  external loudness : encoder -> Loudness.t = "ocaml_opus_encoder_loudness"
+
+  let enable_loudness t = enable_loudness t.enc
+  let loudness t = loudness t.enc
+  let collect_timing t hist = collect_timing t.enc hist
+  let request_complexity t n = check (request_complexity t.enc n)
 
-  let apply_control control enc = apply_control control enc.enc
+  (* Polymorphic variant tags are hashed at compile-time so this dispatch does
+     not involve any string hashing. *)
+  let apply_control control t =
+    match control with
+      | `Reset_state -> reset_state t
+      | `Get_final_range r -> r := get_final_range t
+      | `Get_pitch r -> r := get_pitch t
+      | `Get_bandwidth r -> r := get_bandwidth t
+      | `Set_lsb_depth n -> set_lsb_depth t n
+      | `Get_lsb_depth r -> r := get_lsb_depth t
+      | `Set_phase_inversion_disabled b -> set_phase_inversion_disabled t b
+      | `Set_complexity n -> set_complexity t n
+      | `Get_complexity r -> r := get_complexity t
+      | `Set_bitrate b -> set_bitrate t (int_of_bitrate b)
+      | `Get_bitrate r -> (
+          match bitrate_of_int (requested_bitrate t.enc) with
+            | `Bitrate _ -> r := bitrate_of_int (get_bitrate t)
+            | b -> r := b)
+      | `Set_vbr b -> set_vbr t b
+      | `Get_vbr r -> r := get_vbr t
+      | `Set_vbr_constraint b -> set_vbr_constraint t b
+      | `Get_vbr_constraint r -> r := get_vbr_constraint t
+      | `Set_force_channels b ->
+          check (set_force_channels t.enc (Bool.to_int b))
+      | `Get_force_channels r -> r := get_force_channels t.enc = 1
+      | `Set_max_bandwidth b -> set_max_bandwidth t b
+      | `Get_max_bandwidth r -> r := get_max_bandwidth t
+      | `Set_bandwidth b -> set_bandwidth t b
+      | `Set_signal s -> set_signal t s
+      | `Get_signal r -> r := get_signal t
+      | `Set_application a -> set_application t a
+      | `Get_application r -> r := get_application t
+      | `Get_samplerate r -> r := get_samplerate t
+      | `Get_lookahead r | `Get_lookhead r -> r := get_lookahead t
+      | `Set_inband_fec b -> set_inband_fec t b
+      | `Get_inband_fec r -> r := get_inband_fec t
+      | `Set_packet_loss_perc n -> set_packet_loss_perc t n
+      | `Get_packet_loss_perc r -> r := get_packet_loss_perc t
+      | `Set_dtx b -> set_dtx t b
+      | `Get_dtx r -> r := get_dtx t
+
+  type activity =
+    (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  type mode = [ `Silk | `Hybrid | `Celt ]
+
+  (* Flags set in the C stubs. *)
+  let frame_emitted activity n = activity.{n} land 1 <> 0
+  let frame_in_dtx activity n = activity.{n} land 2 <> 0
+
+  let frame_mode activity n =
+    match (activity.{n} lsr 2) land 3 with
+      | 0 -> `Silk
+      | 1 -> `Hybrid
+      | _ -> `Celt
 
   external encode_float :
     frame_size:int ->
@@ -187,6 +654,8 @@ module Encoder = struct
     float array array ->
     int ->
     int ->
+    int ->
+    activity option ->
     int = "ocaml_opus_encode_float_byte" "ocaml_opus_encode_float"
 
   external encode_float_ba :
@@ -196,16 +665,472 @@ module Encoder = struct
     (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
     int ->
     int ->
+    int ->
+    activity option ->
     int = "ocaml_opus_encode_float_ba_byte" "ocaml_opus_encode_float_ba"
 
-  let mk_encode_float fn ?(frame_size = 20.) t =
-    let frame_size = frame_size *. float t.samplerate /. 1000. in
-    fn ~frame_size:(int_of_float frame_size) t.enc t.os
+  let frame_size ?(frame_size = 20.) t =
+    int_of_float (frame_size *. float t.samplerate /. 1000.)
+
+  let mk_encode_float fn ?frame_size ?activity t buf ofs len =
+    fn ~frame_size:(frame_size ?frame_size t) t.enc t.os buf ofs len (-1)
+      activity
+
+  (* The input is padded with silence to cover the encoder's delay. The
+     granule position of the last packet only accounts for actual input
+     samples so that decoders trim the padding. *)
+  let mk_flush fn ~make ~blit ?frame_size t buf ofs len =
+    let frame_size = frame_size ?frame_size t in
+    let ratio = 48000 / t.samplerate in
+    let pre_skip = (pre_skip t + ratio - 1) / ratio in
+    let padded = (pre_skip + len + frame_size - 1) / frame_size * frame_size in
+    let padded = max frame_size padded in
+    let pcm =
+      Array.map
+        (fun b ->
+          let p = make padded in
+          blit b ofs p len;
+          p)
+        buf
+    in
+    ignore (fn ~frame_size t.enc t.os pcm 0 padded len None)
+
+  let flush =
+    mk_flush encode_float
+      ~make:(fun len -> Array.make len 0.)
+      ~blit:(fun b ofs p len -> Array.blit b ofs p 0 len)
+
+  let flush_ba =
+    mk_flush encode_float_ba
+      ~make:(fun len ->
+        let p = Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout len in
+        Bigarray.Array1.fill p 0.;
+        p)
+      ~blit:(fun b ofs p len ->
+        Bigarray.Array1.blit (Bigarray.Array1.sub b ofs len)
+          (Bigarray.Array1.sub p 0 len))
 
   let encode_float = mk_encode_float encode_float
   let encode_float_ba = mk_encode_float encode_float_ba
 
+  external encode_many :
+    encoder array ->
+    int ->
+    int ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    int array ->
+    (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    int array ->
+    int array ->
+    int array
+    = "ocaml_opus_encoder_encode_many_byte" "ocaml_opus_encoder_encode_many"
+
+  (* Frame size is passed in samples at 48kHz. *)
+  let encode_many ?(frame_size = 20.) ?(threads = 1) encoders ~pcm ~pcm_ofs
+      ~data ~data_ofs ~data_len =
+    encode_many
+      (Array.map (fun t -> t.enc) encoders)
+      (int_of_float (frame_size *. 48.))
+      threads pcm pcm_ofs data data_ofs data_len
+
   external eos : Ogg.Stream.stream -> encoder -> unit = "ocaml_opus_encode_eos"
 
   let eos t = eos t.os t.enc
+
+  external drain : encoder -> Ogg.Stream.stream -> unit
+    = "ocaml_opus_encoder_drain"
+
+  external encode_segment :
+    frame_size:int ->
+    encoder ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    string array = "ocaml_opus_encoder_encode_segment"
+
+  external splice : encoder -> Ogg.Stream.stream -> string array -> unit
+    = "ocaml_opus_encoder_splice"
+
+  let drain t = drain t.enc t.os
+  let encode_segment ~frame_size t buf ofs len =
+    encode_segment ~frame_size t.enc buf ofs len
+
+  let splice t packets = splice t.enc t.os packets
+end
+
+module Cache = struct
+  type key = {
+    id : string;
+    length : int;
+    samplerate : int;
+    channels : int;
+    bitrate : int;
+    application : Encoder.application;
+    frame_size : int;
+  }
+
+  type entry = { packets : string array; size : int; mutable last_use : int }
+
+  type stats = {
+    hits : int;
+    misses : int;
+    evictions : int;
+    entries : int;
+    bytes : int;
+  }
+
+  type t = {
+    max_bytes : int;
+    table : (key, entry) Hashtbl.t;
+    mutable total_bytes : int;
+    mutable clock : int;
+    mutable hit_count : int;
+    mutable miss_count : int;
+    mutable eviction_count : int;
+  }
+
+  let create ?(max_bytes = 16 * 1024 * 1024) () =
+    {
+      max_bytes;
+      table = Hashtbl.create 64;
+      total_bytes = 0;
+      clock = 0;
+      hit_count = 0;
+      miss_count = 0;
+      eviction_count = 0;
+    }
+
+  let stats t =
+    {
+      hits = t.hit_count;
+      misses = t.miss_count;
+      evictions = t.eviction_count;
+      entries = Hashtbl.length t.table;
+      bytes = t.total_bytes;
+    }
+
+  let clear t =
+    Hashtbl.reset t.table;
+    t.total_bytes <- 0
+
+  external hash :
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    int64 = "ocaml_opus_segment_hash"
+
+  (* Segments are few, a linear scan is enough to find the least recently
+     used one. *)
+  let evict t =
+    while t.total_bytes > t.max_bytes && Hashtbl.length t.table > 0 do
+      let key, entry =
+        Hashtbl.fold
+          (fun k e -> function
+            | Some (_, e') as acc when e'.last_use <= e.last_use -> acc
+            | _ -> Some (k, e))
+          t.table None
+        |> Option.get
+      in
+      Hashtbl.remove t.table key;
+      t.total_bytes <- t.total_bytes - entry.size;
+      t.eviction_count <- t.eviction_count + 1
+    done
+
+  let splice ?frame_size ?key t encoder buf ofs len =
+    let frame_size = Encoder.frame_size ?frame_size encoder in
+    let id =
+      match key with Some k -> k | None -> Int64.to_string (hash buf ofs len)
+    in
+    let key =
+      {
+        id;
+        length = len;
+        samplerate = encoder.Encoder.samplerate;
+        channels = Array.length buf;
+        bitrate = Encoder.get_bitrate encoder;
+        application = Encoder.get_application encoder;
+        frame_size;
+      }
+    in
+    Encoder.drain encoder;
+    t.clock <- t.clock + 1;
+    let packets =
+      match Hashtbl.find_opt t.table key with
+        | Some entry ->
+            t.hit_count <- t.hit_count + 1;
+            entry.last_use <- t.clock;
+            entry.packets
+        | None ->
+            t.miss_count <- t.miss_count + 1;
+            let packets =
+              Encoder.encode_segment ~frame_size encoder buf ofs len
+            in
+            let size =
+              Array.fold_left (fun n p -> n + String.length p) 0 packets
+            in
+            Hashtbl.replace t.table key { packets; size; last_use = t.clock };
+            t.total_bytes <- t.total_bytes + size;
+            evict t;
+            packets
+    in
+    Encoder.splice encoder packets
+end
+
+module Governor = struct
+  type decision = [ `Step_down | `Step_up | `Hold ]
+
+  type event = {
+    decision : decision;
+    complexity : int;
+    load : float;
+    p99 : float;
+    frames : int;
+  }
+
+  type t = {
+    min_complexity : int;
+    max_complexity : int;
+    target_load : float;
+    target_p99 : float;
+    headroom : float;
+    on_event : event -> unit;
+    mutable complexity : int;
+    mutable encoders : Encoder.t list;
+    mutable decoders : Decoder.t list;
+    mutable last_update : float;
+    (* Frame times histogram, see timing_t in the C stubs. *)
+    hist : int array;
+  }
+
+  let create ?(min_complexity = 0) ?(max_complexity = 10) ?(target_load = 1.)
+      ?(target_p99 = 0.01) ?(headroom = 0.75) ?(on_event = fun _ -> ()) () =
+    {
+      min_complexity;
+      max_complexity;
+      target_load;
+      target_p99;
+      headroom;
+      on_event;
+      complexity = max_complexity;
+      encoders = [];
+      decoders = [];
+      last_update = Unix.gettimeofday ();
+      hist = Array.make 64 0;
+    }
+
+  let complexity t = t.complexity
+
+  (* Complexity is applied by the handles before their next frame, so that
+     [update] can run in another domain. Closed handles are removed from the
+     group. *)
+  let set_encoder_complexity t e =
+    try
+      Encoder.request_complexity e t.complexity;
+      true
+    with Invalid_state -> false
+
+  let set_decoder_complexity t d =
+    try
+      Decoder.request_complexity d t.complexity;
+      true
+    with Invalid_state -> false
+
+  let add_encoder t e =
+    if set_encoder_complexity t e then (
+      Encoder.set_timing e true;
+      t.encoders <- e :: t.encoders)
+
+  let add_decoder t d =
+    if set_decoder_complexity t d then (
+      Decoder.set_timing d true;
+      t.decoders <- d :: t.decoders)
+
+  let remove_encoder t e =
+    Encoder.set_timing e false;
+    t.encoders <- List.filter (fun e' -> e' != e) t.encoders
+
+  let remove_decoder t d =
+    Decoder.set_timing d false;
+    t.decoders <- List.filter (fun d' -> d' != d) t.decoders
+
+  (* Upper bound of an histogram bucket, in seconds. *)
+  let bucket_duration n =
+    let n = n + 1 in
+    let us = if n < 4 then n else (4 + (n mod 4)) lsl ((n / 4) - 1) in
+    float us /. 1_000_000.
+
+  let percentile hist frames p =
+    let target = int_of_float (ceil (p *. float frames)) in
+    let rec f n acc =
+      let acc = acc + hist.(n) in
+      if acc >= target || n = Array.length hist - 1 then bucket_duration n
+      else f (n + 1) acc
+    in
+    f 0 0
+
+  let update t =
+    let now = Unix.gettimeofday () in
+    let elapsed = now -. t.last_update in
+    t.last_update <- now;
+    Array.fill t.hist 0 (Array.length t.hist) 0;
+    let total_ns =
+      List.fold_left
+        (fun n e -> n + Encoder.collect_timing e t.hist)
+        0 t.encoders
+    in
+    let total_ns =
+      List.fold_left
+        (fun n d -> n + Decoder.collect_timing d t.hist)
+        total_ns t.decoders
+    in
+    let frames = Array.fold_left ( + ) 0 t.hist in
+    let load =
+      if elapsed > 0. then float total_ns /. 1_000_000_000. /. elapsed else 0.
+    in
+    let p99 = if frames > 0 then percentile t.hist frames 0.99 else 0. in
+    let decision =
+      if frames = 0 then `Hold
+      else if
+        (load > t.target_load || p99 > t.target_p99)
+        && t.complexity > t.min_complexity
+      then `Step_down
+      else if
+        load < t.headroom *. t.target_load
+        && p99 < t.headroom *. t.target_p99
+        && t.complexity < t.max_complexity
+      then `Step_up
+      else `Hold
+    in
+    (match decision with
+      | `Step_down -> t.complexity <- t.complexity - 1
+      | `Step_up -> t.complexity <- t.complexity + 1
+      | `Hold -> ());
+    if decision <> `Hold then (
+      t.encoders <- List.filter (set_encoder_complexity t) t.encoders;
+      t.decoders <- List.filter (set_decoder_complexity t) t.decoders);
+    let event = { decision; complexity = t.complexity; load; p99; frames } in
+    t.on_event event;
+    event
+end
+
+module File = struct
+  type data =
+    (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  type reader
+
+  external create : data -> bool -> reader = "ocaml_opus_file_create"
+  external close : reader -> unit = "ocaml_opus_file_close"
+  external next_packet : reader -> bool = "ocaml_opus_file_next_packet"
+
+  external packet_bos : reader -> bool = "ocaml_opus_file_packet_bos"
+    [@@noalloc]
+
+  external packet : reader -> string = "ocaml_opus_file_packet"
+
+  external comments : reader -> string * string array
+    = "ocaml_opus_file_comments"
+
+  external create_decoder :
+    samplerate:int -> channels:int -> pre_skip:int -> Decoder.decoder
+    = "ocaml_opus_decoder_create"
+
+  external close_decoder : Decoder.decoder -> unit = "ocaml_opus_decoder_close"
+
+  external set_gain : Decoder.decoder -> int -> int
+    = "ocaml_opus_decoder_set_gain"
+    [@@noalloc]
+
+  type t = {
+    reader : reader;
+    samplerate : int;
+    mutable decoder : Decoder.decoder;
+    mutable header : string;
+    mutable comments : string * (string * string) list;
+  }
+
+  (* Read the headers of the stream starting at the current packet. *)
+  let read_headers ~samplerate reader =
+    let header = packet reader in
+    let byte n = Char.code header.[n] in
+    if (not (packet_bos reader)) || String.length header < 19 || byte 8 <> 1
+    then raise Invalid_packet;
+    let channels = byte 9 in
+    (* Pre-skip is expressed at 48kHz. *)
+    let pre_skip = (byte 10 lor (byte 11 lsl 8)) * samplerate / 48000 in
+    let gain = byte 16 lor (byte 17 lsl 8) in
+    let gain = if gain land 0x8000 <> 0 then gain - 0x10000 else gain in
+    if (not (next_packet reader)) || packet_bos reader then
+      raise Invalid_packet;
+    let comments = split_comments (comments reader) in
+    let decoder = create_decoder ~samplerate ~channels ~pre_skip in
+    check (set_gain decoder gain);
+    (decoder, header, comments)
+
+  let of_bigarray ?(samplerate = 48000) ?(sequential = true) data =
+    let reader = create data sequential in
+    if not (next_packet reader) then raise Invalid_packet;
+    let decoder, header, comments = read_headers ~samplerate reader in
+    { reader; samplerate; decoder; header; comments }
+
+  let openfile ?samplerate ?sequential fname =
+    let fd = Unix.openfile fname [Unix.O_RDONLY] 0 in
+    let data =
+      Fun.protect
+        ~finally:(fun () -> Unix.close fd)
+        (fun () ->
+          Bigarray.array1_of_genarray
+            (Unix.map_file fd Bigarray.char Bigarray.c_layout false [| -1 |]))
+    in
+    of_bigarray ?samplerate ?sequential data
+
+  let channels t = Char.code t.header.[9]
+  let comments t = t.comments
+
+  let pre_skip t =
+    Char.code t.header.[10] lor (Char.code t.header.[11] lsl 8)
+
+  let close t =
+    close_decoder t.decoder;
+    close t.reader
+
+  external decode_float :
+    reader ->
+    Decoder.decoder ->
+    float array array ->
+    int ->
+    int ->
+    bool ->
+    int = "ocaml_opus_file_decode_float_byte" "ocaml_opus_file_decode_float"
+
+  external decode_float_ba :
+    reader ->
+    Decoder.decoder ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    bool ->
+    int
+    = "ocaml_opus_file_decode_float_ba_byte" "ocaml_opus_file_decode_float_ba"
+
+  (* Decoding stops at the end of each chained stream. *)
+  let mk_decode fn ?(decode_fec = false) t buf ofs len =
+    let rec decode () =
+      match fn t.reader t.decoder buf ofs len decode_fec with
+        | 0 when len > 0 ->
+            if not (next_packet t.reader) then raise Ogg.End_of_stream;
+            let decoder, header, comments =
+              read_headers ~samplerate:t.samplerate t.reader
+            in
+            close_decoder t.decoder;
+            t.decoder <- decoder;
+            t.header <- header;
+            t.comments <- comments;
+            decode ()
+        | n -> n
+    in
+    decode ()
+
+  let decode_float = mk_decode decode_float
+  let decode_float_ba = mk_decode decode_float_ba
 end
@@ -25,19 +25,132 @@ type generic_control =
   | `Get_lsb_depth of int ref
   | `Set_phase_inversion_disabled of bool ]
 
+(** EBU R128 loudness measurement. Meters are attached to decoders or
+    encoders and fed while samples are converted to or from their
+    interleaved representation. *)
+module Loudness : sig
+  type t = {
+    integrated : float;  (** Gated integrated loudness, in LUFS. *)
+    range : float;  (** Loudness range, in LU. *)
+    true_peak : float;  (** In dBTP. *)
+    sample_peak : float;  (** In dBFS. *)
+  }
+
+  (** Gain bringing the integrated loudness to [target] (default: [-23.]
+      LUFS), in Q7.8 dB units as used by the header output gain and the
+      [R128_TRACK_GAIN] tag. *)
+  val r128_gain : ?target:float -> t -> int
+
+  (** ReplayGain track gain in dB, relative to a [reference] loudness
+      (default: [-18.] LUFS). *)
+  val replaygain : ?reference:float -> t -> float
+
+  (** [REPLAYGAIN_TRACK_GAIN] and [REPLAYGAIN_TRACK_PEAK] tags. These should
+      not be used in Ogg Opus streams, see [set_track_gain]. *)
+  val replaygain_tags : ?reference:float -> t -> (string * string) list
+
+  (** Output gain of an [OpusHead] packet, in Q7.8 dB units. *)
+  val header_gain : Ogg.Stream.packet -> int
+
+  (** Copy of an [OpusHead] packet with the given output gain, clamped to
+      the range of the field. When normalizing decoded data, which already has
+      the header's gain applied, use [header_gain p + r128_gain l]. *)
+  val set_header_gain : Ogg.Stream.packet -> int -> Ogg.Stream.packet
+
+  (** Copy of an [OpusTags] packet with the given tags, replacing existing
+      ones with the same name. *)
+  val set_tags :
+    Ogg.Stream.packet -> (string * string) list -> Ogg.Stream.packet
+
+  (** Set the [R128_TRACK_GAIN] tag, which is applied on top of the header
+      output gain. *)
+  val set_track_gain : Ogg.Stream.packet -> int -> Ogg.Stream.packet
+end
+
 module Decoder : sig
   type control = [ generic_control | `Set_gain of int | `Get_gain of int ref ]
+
+  (** Decoders can be created and used from any domain but a given decoder
+      must not be used by several domains or threads at the same time. *)
   type t
 
   val check_packet : Ogg.Stream.packet -> bool
 
-  (** Create a decoder with given samplerate an number of channels. *)
-  val create : ?samplerate:int -> Ogg.Stream.packet -> Ogg.Stream.packet -> t
+  (** Create a decoder with given samplerate an number of channels. The
+      decoder discards the pre-skip samples at the beginning of the stream and
+      applies the output gain specified in the header. [channels] is the
+      number of channels decoded by libopus, [1] or [2], and defaults to the
+      stream's. Packets are decoded to this number of channels whatever
+      theirs, e.g. use [~channels:1] to have stereo streams decoded directly
+      to mono. *)
+  val create :
+    ?samplerate:int ->
+    ?channels:int ->
+    Ogg.Stream.packet ->
+    Ogg.Stream.packet ->
+    t
+
+  (** Number of channels produced by libopus, see [create]. *)
+  val decoded_channels : t -> int
+
+  (** Output buffers may have any number of channels. When it differs from
+      [decoded_channels], samples are mixed while being copied to the
+      buffers. By default, decoded mono is copied to every output channel,
+      decoded channels are averaged to mono and otherwise mapped one to one.
+
+      [set_mix t m] sets the mixing matrix instead: [m.(o).(c)] is the gain
+      of decoded channel [c] in output channel [o]. Buffers must then have
+      [Array.length m] channels. Mixing does not apply to [decode_many]. *)
+  val set_mix : t -> float array array -> unit
+
+  (** Restore the default mix. *)
+  val reset_mix : t -> unit
+
+  (** Free the decoder's state immediately instead of waiting for the GC. Any
+      later use of the decoder raises [Invalid_state]. Decoding runs without
+      the OCaml runtime lock: [close] must not be called while another thread
+      or domain is using the decoder, including through [decode_many]. *)
+  val close : t -> unit
 
   val comments : t -> string * (string * string) list
   val channels : t -> int
+
+  (** Pre-skip from the header, in samples at 48kHz. *)
+  val pre_skip : t -> int
+
   val apply_control : control -> t -> unit
 
+  (** {2 Typed controls}
+
+      These are direct bindings to the corresponding [OPUS_*] controls. Unlike
+      [apply_control], they do not go through a polymorphic variant and setters
+      do not allocate. *)
+
+  val reset_state : t -> unit
+  val get_final_range : t -> int
+  val get_pitch : t -> int
+  val get_bandwidth : t -> bandwidth
+  val set_lsb_depth : t -> int -> unit
+  val get_lsb_depth : t -> int
+  val set_phase_inversion_disabled : t -> bool -> unit
+
+  (** Gain in Q8 dB units. *)
+  val set_gain : t -> int -> unit
+
+  val get_gain : t -> int
+
+  (** Only supported by recent versions of libopus, raises [Unimplemented] or
+      [Invalid_argument] otherwise. *)
+  val set_complexity : t -> int -> unit
+
+  (** Start measuring the loudness of decoded samples, discarding previous
+      measurements. *)
+  val enable_loudness : t -> unit
+
+  (** Loudness of the samples decoded since [enable_loudness]. Raises
+      [Invalid_argument] if measurement is not enabled. *)
+  val loudness : t -> Loudness.t
+
   val decode_float :
     ?decode_fec:bool ->
     t ->
@@ -55,6 +168,31 @@ module Decoder : sig
     int ->
     int ->
     int
+
+  (** Decode one raw packet for each decoder in a single call, without the
+      OCaml runtime. The packet of the [i]-th decoder is read from [data] at
+      [data_ofs.(i)] and is [data_len.(i)] bytes long, an empty packet being
+      decoded as lost. At most [pcm_len.(i)] samples of [decoded_channels]
+      channels are written interleaved to [pcm] from [pcm_ofs.(i)]: the mix set
+      by [set_mix] is ignored. Decoding is spread over [threads] threads
+      (default: [1]), in which case repetitions of a decoder fail with [-1]
+      ([OPUS_BAD_ARG]). Threads are started on each call, which only pays off
+      for very large batches.
+
+      Returns, for each decoder, the number of decoded samples or a negative
+      libopus error code. No exception is raised for individual decoders. *)
+  val decode_many :
+    ?decode_fec:bool ->
+    ?threads:int ->
+    t array ->
+    data:
+      (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    data_ofs:int array ->
+    data_len:int array ->
+    pcm:(float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    pcm_ofs:int array ->
+    pcm_len:int array ->
+    int array
 end
 
 module Encoder : sig
@@ -75,14 +213,15 @@ module Encoder : sig
     | `Set_force_channels of bool
     | `Get_force_channels of bool ref
     | `Set_max_bandwidth of max_bandwidth
-    | `Get_max_bandwidth of max_bandwidth
+    | `Get_max_bandwidth of max_bandwidth ref
     | `Set_bandwidth of bandwidth
     | `Set_signal of signal
     | `Get_signal of signal ref
     | `Set_application of application
-    | `Get_application of application
-    | `Get_samplerate of int
-    | `Get_lookhead of int
+    | `Get_application of application ref
+    | `Get_samplerate of int ref
+    | `Get_lookahead of int ref
+    | `Get_lookhead of int ref  (** Same as [`Get_lookahead]. *)
     | `Set_inband_fec of bool
     | `Get_inband_fec of bool ref
     | `Set_packet_loss_perc of int
@@ -90,8 +229,12 @@ module Encoder : sig
     | `Set_dtx of bool
     | `Get_dtx of bool ref ]
 
+  (** Encoders can be created and used from any domain but a given encoder
+      must not be used by several domains or threads at the same time. *)
   type t
 
+  (** Create an encoder. [pre_skip], in samples at 48kHz, defaults to the
+      encoder's lookahead. *)
   val create :
     ?pre_skip:int ->
     ?comments:(string * string) list ->
@@ -104,22 +247,303 @@ module Encoder : sig
 
   val header : t -> Ogg.Stream.packet
   val comments : t -> Ogg.Stream.packet
+
+  (** Free the encoder's state immediately instead of waiting for the GC. Any
+      later use of the encoder raises [Invalid_state]. Encoding runs without
+      the OCaml runtime lock: [close] must not be called while another thread
+      or domain is using the encoder, including through [encode_many] or
+      [Cache.splice]. *)
+  val close : t -> unit
+
+  (** Pre-skip, in samples at 48kHz. *)
+  val pre_skip : t -> int
+
   val apply_control : control -> t -> unit
 
+  (** {2 Typed controls}
+
+      These are direct bindings to the corresponding [OPUS_*] controls. Unlike
+      [apply_control], they do not go through a polymorphic variant and setters
+      do not allocate. *)
+
+  val reset_state : t -> unit
+  val get_final_range : t -> int
+  val get_pitch : t -> int
+  val get_bandwidth : t -> bandwidth
+  val set_lsb_depth : t -> int -> unit
+  val get_lsb_depth : t -> int
+  val set_phase_inversion_disabled : t -> bool -> unit
+  val set_complexity : t -> int -> unit
+  val get_complexity : t -> int
+
+  (** Bitrate in bits per second. Use [apply_control] to set [`Auto] or
+      [`Bitrate_max]. *)
+  val set_bitrate : t -> int -> unit
+
+  (** Bitrate used by libopus. [`Get_bitrate] returns [`Auto] or
+      [`Bitrate_max] instead when they were set. *)
+  val get_bitrate : t -> int
+  val set_vbr : t -> bool -> unit
+  val get_vbr : t -> bool
+  val set_vbr_constraint : t -> bool -> unit
+  val get_vbr_constraint : t -> bool
+  val set_max_bandwidth : t -> max_bandwidth -> unit
+  val get_max_bandwidth : t -> max_bandwidth
+  val set_bandwidth : t -> bandwidth -> unit
+  val set_signal : t -> signal -> unit
+  val get_signal : t -> signal
+  val set_application : t -> application -> unit
+  val get_application : t -> application
+  val get_samplerate : t -> int
+
+  (** Encoder lookahead, in samples at the encoder's samplerate. *)
+  val get_lookahead : t -> int
+
+  val set_inband_fec : t -> bool -> unit
+  val get_inband_fec : t -> bool
+  val set_packet_loss_perc : t -> int -> unit
+  val get_packet_loss_perc : t -> int
+  val set_dtx : t -> bool -> unit
+  val get_dtx : t -> bool
+
+  (** Start measuring the loudness of encoded samples, discarding previous
+      measurements. Padding added by [flush] is not measured and the header
+      output gain is not applied. *)
+  val enable_loudness : t -> unit
+
+  (** Loudness of the samples encoded since [enable_loudness]. Raises
+      [Invalid_argument] if measurement is not enabled. *)
+  val loudness : t -> Loudness.t
+
+  (** Per-frame activity reported by [encode_float], one entry per encoded
+      frame. *)
+  type activity =
+    (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  (** Coding mode chosen by the encoder for a frame. [`Silk] is used for
+      speech, [`Celt] for music and [`Hybrid] for wide band speech. *)
+  type mode = [ `Silk | `Hybrid | `Celt ]
+
+  (** Whether the [n]-th frame was emitted. Frames are suppressed when DTX is
+      enabled and the encoder detects silence. *)
+  val frame_emitted : activity -> int -> bool
+
+  (** Whether the encoder was in DTX state after the [n]-th frame. With older
+      versions of libopus, this is the same as the frame being suppressed. *)
+  val frame_in_dtx : activity -> int -> bool
+
+  val frame_mode : activity -> int -> mode
+
+  (** Encode as many frames as possible and return the number of samples
+      consumed. When given, [activity] is filled with the activity of each
+      encoded frame and must be large enough to hold them. Suppressed frames
+      still advance the granule position. *)
   val encode_float :
-    ?frame_size:float -> t -> float array array -> int -> int -> int
+    ?frame_size:float ->
+    ?activity:activity ->
+    t ->
+    float array array ->
+    int ->
+    int ->
+    int
 
   val encode_float_ba :
     ?frame_size:float ->
+    ?activity:activity ->
     t ->
     (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
     int ->
     int ->
     int
 
+  (** Encode the last [len] samples of the stream, which do not need to fill a
+      whole frame, and end the stream. The granule position of the last packet
+      is set so that decoders drop the padding added at the end. *)
+  val flush :
+    ?frame_size:float -> t -> float array array -> int -> int -> unit
+
+  val flush_ba :
+    ?frame_size:float ->
+    t ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    unit
+
+  (** Encode one frame of [frame_size] milliseconds (default: [20.]) for each
+      encoder in a single call, without the OCaml runtime. The interleaved
+      input of the [i]-th encoder is read from [pcm] at [pcm_ofs.(i)] and its
+      raw packet is written to [data] at [data_ofs.(i)], using at most
+      [data_len.(i)] bytes. Packets are not added to the encoder's Ogg stream.
+      Encoding is spread over [threads] threads (default: [1]), in which case
+      repetitions of an encoder fail with [-1] ([OPUS_BAD_ARG]). Threads are
+      started on each call, which only pays off for very large batches.
+
+      Returns, for each encoder, the size of its packet or a negative libopus
+      error code. No exception is raised for individual encoders. *)
+  val encode_many :
+    ?frame_size:float ->
+    ?threads:int ->
+    t array ->
+    pcm:(float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    pcm_ofs:int array ->
+    data:
+      (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    data_ofs:int array ->
+    data_len:int array ->
+    int array
+
   val eos : t -> unit
     [@@alert
       deprecated
         "This function generates invalid bitstream. Please use \
-         Ogg.Stream.terminate instead!"]
+         Encoder.flush instead!"]
+end
+
+(** Cache of encoded segments, for content which is repeatedly encoded such
+    as jingles or station IDs. Segments are keyed by their content and the
+    encoder's samplerate, channels, bitrate, application and frame size.
+
+    Segments are encoded from a reset encoder, with enough silence to flush
+    the encoder's delay. When splicing a segment, the delay of the live
+    encoder is first flushed with a short frame and the encoder is reset
+    afterward so that decoders only switch state on silence. Live input is
+    faded out before and faded in after the segment, and the segment itself is
+    faded in and out, each over 2.5ms.
+
+    Granule positions count every decoded sample, as required for Ogg Opus,
+    so the silence around a segment is played: each splice adds up to 2.5ms
+    of padding and the encoder's delay twice (about 15ms at 48kHz, or 5ms
+    with the restricted low delay application). *)
+module Cache : sig
+  type t
+
+  type stats = {
+    hits : int;
+    misses : int;
+    evictions : int;
+    entries : int;
+    bytes : int;  (** Size of the cached packets. *)
+  }
+
+  (** Create a cache holding at most [max_bytes] (default: 16MiB) of packets.
+      Least recently used segments are evicted first. *)
+  val create : ?max_bytes:int -> unit -> t
+
+  val stats : t -> stats
+  val clear : t -> unit
+
+  (** [splice cache encoder buf ofs len] adds the packets of the given
+      segment to the encoder's stream, encoding and caching them if needed.
+      Granule positions and packet numbers continue those of the encoder.
+      [key] identifies the segment's content and defaults to a hash of its
+      samples. *)
+  val splice :
+    ?frame_size:float ->
+    ?key:string ->
+    t ->
+    Encoder.t ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    unit
+end
+
+(** Adjust the complexity of a group of encoders and decoders to keep their
+    CPU usage within a budget. The time spent in libopus for each frame is
+    measured by the handles of the group and collected on each [update], which
+    should be called periodically, e.g. every second. [update] may run in
+    another domain than the handles: new complexities are applied by each
+    handle before its next frame. The governor itself must only be used from
+    one domain at a time. *)
+module Governor : sig
+  type t
+  type decision = [ `Step_down | `Step_up | `Hold ]
+
+  type event = {
+    decision : decision;
+    complexity : int;  (** Complexity after the decision. *)
+    load : float;  (** CPU time over wall-clock time since the last update. *)
+    p99 : float;  (** 99th percentile of the frame time, in seconds. *)
+    frames : int;  (** Number of frames processed since the last update. *)
+  }
+
+  (** Create a governor. Complexity starts at [max_complexity] (default:
+      [10]) and never goes under [min_complexity] (default: [0]). It is
+      stepped down when the load exceeds [target_load] (default: [1.], i.e. one
+      core) or the p99 frame time exceeds [target_p99] (default: [0.01]
+      seconds), and stepped back up when both are under [headroom] (default:
+      [0.75]) times their target. [on_event] is called on each update. *)
+  val create :
+    ?min_complexity:int ->
+    ?max_complexity:int ->
+    ?target_load:float ->
+    ?target_p99:float ->
+    ?headroom:float ->
+    ?on_event:(event -> unit) ->
+    unit ->
+    t
+
+  (** Current complexity. *)
+  val complexity : t -> int
+
+  (** Add a handle to the group. Its complexity is set before its next frame;
+      decoders are only adjusted if libopus supports it. Closed handles are
+      silently dropped. *)
+  val add_encoder : t -> Encoder.t -> unit
+
+  val add_decoder : t -> Decoder.t -> unit
+  val remove_encoder : t -> Encoder.t -> unit
+  val remove_decoder : t -> Decoder.t -> unit
+
+  (** Collect frame times, take a decision and apply it to the group. *)
+  val update : t -> event
+end
+
+(** Reader for Ogg Opus files. Files are memory-mapped and their pages are
+    checked and read in place, without going through [Ogg.Sync] and
+    [Ogg.Stream]: packets are only copied when they span several pages.
+    Chained streams are decoded one after the other. *)
+module File : sig
+  type t
+
+  type data =
+    (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  (** Map a file and read the headers of its first Opus stream. When
+      [sequential] is [true] (default), the kernel is advised that the file is
+      read sequentially. *)
+  val openfile : ?samplerate:int -> ?sequential:bool -> string -> t
+
+  (** Same as [openfile] for data which is already in memory. *)
+  val of_bigarray : ?samplerate:int -> ?sequential:bool -> data -> t
+
+  (** Number of channels of the current stream. *)
+  val channels : t -> int
+
+  (** Comments of the current stream. *)
+  val comments : t -> string * (string * string) list
+
+  (** Pre-skip of the current stream, in samples at 48kHz. *)
+  val pre_skip : t -> int
+
+  (** Decode at most [len] samples. When a new chained stream starts, its
+      headers are read and [channels] and [comments] are updated. Buffers with
+      a different number of channels are filled with the default mix, see
+      [Decoder.set_mix]. Raises [Ogg.End_of_stream] at the end of the file. *)
+  val decode_float :
+    ?decode_fec:bool -> t -> float array array -> int -> int -> int
+
+  val decode_float_ba :
+    ?decode_fec:bool ->
+    t ->
+    (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t array ->
+    int ->
+    int ->
+    int
+
+  (** Free the decoder and release the mapped data. Any later decoding raises
+      [Invalid_state]. [close] must not be called while another thread or
+      domain is decoding from the file. *)
+  val close : t -> unit
 end
@@ -23,7 +23,7 @@ let check = Opus.Decoder.check_packet
 let buflen = Opus.recommended_frame_size
 let decoder_samplerate = ref 48000
 
-let decoder os =
+let decoder ?(samplerate = !decoder_samplerate) os =
   let decoder = ref None in
   let packet1 = ref None in
   let packet2 = ref None in
@@ -47,9 +47,7 @@ let decoder os =
                   p
               | Some p -> p
           in
-          let dec =
-            Opus.Decoder.create ~samplerate:!decoder_samplerate packet1 packet2
-          in
+          let dec = Opus.Decoder.create ~samplerate packet1 packet2 in
           let chans = Opus.Decoder.channels dec in
           let meta = Opus.Decoder.comments dec in
           decoder := Some (dec, chans, meta);
@@ -58,35 +56,58 @@ let decoder os =
   in
   let info () =
     let _, chans, meta = init () in
-    ({ Ogg_decoder.channels = chans; sample_rate = !decoder_samplerate }, meta)
+    ({ Ogg_decoder.channels = chans; sample_rate = samplerate }, meta)
   in
   let restart new_os =
     os := new_os;
     decoder := None;
     ignore (init ())
   in
-  let decode ~decode_float ~make_float ~sub_float feed =
-    let dec, chans, _ = init () in
-    let chan _ = make_float buflen in
-    let buf = Array.init chans chan in
-    let ret = decode_float dec !os buf 0 buflen in
-    feed (Array.map (fun x -> sub_float x 0 ret) buf)
+  (* Granule positions are at 48kHz and include pre-skip. *)
+  let samples_of_granulepos x =
+    let dec, _, _ = init () in
+    let x = Int64.sub x (Int64.of_int (Opus.Decoder.pre_skip dec)) in
+    Int64.div (Int64.mul (max 0L x) (Int64.of_int samplerate)) 48000L
+  in
+  (* Decoding buffers are kept across calls. [view buf len] returns a buffer
+     holding the first [len] samples of [buf] and [refresh buf view len]
+     updates it after [buf] has been written to again. Views are re-used as
+     long as the number of decoded samples does not change. *)
+  let decode ~decode_float ~make_float ~view ~refresh =
+    let buf = ref [||] in
+    let out = ref [||] in
+    let out_len = ref (-1) in
+    fun feed ->
+      let dec, chans, _ = init () in
+      if Array.length !buf <> chans then (
+        buf := Array.init chans (fun _ -> make_float buflen);
+        out_len := -1);
+      let buf = !buf in
+      let ret = decode_float dec !os buf 0 buflen in
+      if ret <> !out_len then (
+        out := Array.map (fun x -> view x ret) buf;
+        out_len := ret)
+      else Array.iteri (fun c x -> refresh x !out.(c) ret) buf;
+      feed !out
   in
-  let decoder ~decode_float ~make_float ~sub_float =
+  let decoder ~decode_float ~make_float ~view ~refresh =
     {
       Ogg_decoder.name = "opus";
       info;
-      decode = decode ~decode_float ~make_float ~sub_float;
+      decode = decode ~decode_float ~make_float ~view ~refresh;
       restart;
-      samples_of_granulepos = (fun x -> x);
+      samples_of_granulepos;
     }
   in
   Ogg_decoder.Audio_both
     ( decoder ~decode_float:Opus.Decoder.decode_float
         ~make_float:(fun len -> Array.make len 0.)
-        ~sub_float:Array.sub,
+        ~view:(fun x len -> if len = buflen then x else Array.sub x 0 len)
+        ~refresh:(fun x y len -> if x != y then Array.blit x 0 y 0 len),
       decoder ~decode_float:Opus.Decoder.decode_float_ba
         ~make_float:(Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout)
-        ~sub_float:Bigarray.Array1.sub )
+        ~view:(fun x len -> Bigarray.Array1.sub x 0 len)
+        ~refresh:(fun _ _ _ -> ()) )
 
-let register () = Hashtbl.add Ogg_decoder.ogg_decoders "opus" (check, decoder)
+let register () =
+  Hashtbl.add Ogg_decoder.ogg_decoders "opus" (check, fun os -> decoder os)
@@ -21,7 +21,13 @@
 (** This module provides a opus decoder for
   * the [Ogg_demuxer] module. *)
 
+(** Default samplerate of decoders, read when a decoder is created. *)
 val decoder_samplerate : int ref
 
+(** Create a decoder for the given stream. Buffers passed to the decoding
+    callback are re-used by subsequent calls and should be copied if they need
+    to be kept. *)
+val decoder : ?samplerate:int -> Ogg.Stream.stream -> Ogg_decoder.decoders
+
 (** Register the opus decoder *)
 val register : unit -> unit
@@ -11,8 +11,15 @@
 #define caml_release_runtime_system caml_enter_blocking_section
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
 
 #include <ocaml-ogg.h>
 #include <ogg/ogg.h>
@@ -52,34 +59,81 @@ static inline double clip(double s) {
 /* polymorphic variant utility macro */
 #define get_var(x) caml_hash_variant(#x)
 
-/* Macros to convert variants to controls. */
-#define set_ctl(tag, variant, handle, fn, name, v)                             \
-  if (tag == get_var(variant)) {                                               \
-    check(fn(handle, name(Int_val(v))));                                       \
-    CAMLreturn(Val_unit);                                                      \
+/* Macros to define typed controls. Setters are meant to be [@@noalloc]: they
+ * return the libopus error code, which is checked on the OCaml side. */
+#define set_ctl(prefix, name, handle, fn, ctl)                                 \
+  CAMLprim value ocaml_opus_##prefix##_##name(value _h, value _v) {            \
+    if (handle(_h) == NULL)                                                    \
+      return Val_int(OPUS_INVALID_STATE);                                      \
+    return Val_int(fn(handle(_h), ctl(Int_val(_v))));                          \
   }
 
-#define set_value_ctl(tag, variant, handle, fn, name, v, convert)              \
-  if (tag == get_var(variant)) {                                               \
-    check(fn(handle, name(convert(v))));                                       \
-    CAMLreturn(Val_unit);                                                      \
+#define get_ctl(prefix, name, handle, fn, ctl, type)                           \
+  CAMLprim value ocaml_opus_##prefix##_##name(value _h) {                      \
+    type v;                                                                    \
+    if (handle(_h) == NULL)                                                    \
+      check(OPUS_INVALID_STATE);                                               \
+    check(fn(handle(_h), ctl(&v)));                                            \
+    return Val_long(v);                                                        \
   }
 
-#define get_ctl(tag, variant, handle, fn, name, v, type)                       \
-  if (tag == get_var(variant)) {                                               \
-    type name = (type)Int_val(Field(v, 0));                                    \
-    check(fn(handle, name(&name)));                                            \
-    Store_field(v, 0, Val_int(name));                                          \
-    CAMLreturn(Val_unit);                                                      \
+#define reset_ctl(prefix, handle, fn)                                          \
+  CAMLprim value ocaml_opus_##prefix##_reset_state(value _h) {                 \
+    if (handle(_h) == NULL)                                                    \
+      return Val_int(OPUS_INVALID_STATE);                                      \
+    return Val_int(fn(handle(_h), OPUS_RESET_STATE));                          \
   }
 
-#define get_value_ctl(tag, variant, handle, fn, name, v, type, convert)        \
-  if (tag == get_var(variant)) {                                               \
-    type name = (type)Int_val(Field(v, 0));                                    \
-    check(fn(handle, name(&name)));                                            \
-    Store_field(v, 0, convert(name));                                          \
-    CAMLreturn(Val_unit);                                                      \
+#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
+#define set_phase_inversion_ctl(prefix, handle, fn)                            \
+  set_ctl(prefix, set_phase_inversion_disabled, handle, fn,                    \
+          OPUS_SET_PHASE_INVERSION_DISABLED)
+#else
+#define set_phase_inversion_ctl(prefix, handle, fn)                            \
+  CAMLprim value ocaml_opus_##prefix##_set_phase_inversion_disabled(           \
+      value _h, value _v) {                                                    \
+    return Val_int(OPUS_UNIMPLEMENTED);                                        \
   }
+#endif
+
+/* Controls shared by encoders and decoders. */
+#define generic_ctls(prefix, handle, fn)                                       \
+  reset_ctl(prefix, handle, fn);                                               \
+  get_ctl(prefix, get_final_range, handle, fn, OPUS_GET_FINAL_RANGE,           \
+          opus_uint32);                                                        \
+  get_ctl(prefix, get_pitch, handle, fn, OPUS_GET_PITCH, opus_int32);          \
+  get_ctl(prefix, get_bandwidth, handle, fn, OPUS_GET_BANDWIDTH, opus_int32);  \
+  set_ctl(prefix, set_lsb_depth, handle, fn, OPUS_SET_LSB_DEPTH);              \
+  get_ctl(prefix, get_lsb_depth, handle, fn, OPUS_GET_LSB_DEPTH, opus_int32);  \
+  set_phase_inversion_ctl(prefix, handle, fn)
+
+/* Exceptions are looked up once, when the module is initialized, so that
+ * raising them does not require any lookup and is domain-safe. */
+static const value *opus_exn_buffer_too_small = NULL;
+static const value *opus_exn_internal_error = NULL;
+static const value *opus_exn_invalid_packet = NULL;
+static const value *opus_exn_unimplemented = NULL;
+static const value *opus_exn_invalid_state = NULL;
+static const value *opus_exn_alloc_fail = NULL;
+static const value *ogg_exn_out_of_sync = NULL;
+static const value *ogg_exn_not_enough_data = NULL;
+static const value *ogg_exn_internal_error = NULL;
+
+static void init_crc_table(void);
+
+CAMLprim value ocaml_opus_init(value unit) {
+  opus_exn_buffer_too_small = caml_named_value("opus_exn_buffer_too_small");
+  opus_exn_internal_error = caml_named_value("opus_exn_internal_error");
+  opus_exn_invalid_packet = caml_named_value("opus_exn_invalid_packet");
+  opus_exn_unimplemented = caml_named_value("opus_exn_unimplemented");
+  opus_exn_invalid_state = caml_named_value("opus_exn_invalid_state");
+  opus_exn_alloc_fail = caml_named_value("opus_exn_alloc_fail");
+  ogg_exn_out_of_sync = caml_named_value("ogg_exn_out_of_sync");
+  ogg_exn_not_enough_data = caml_named_value("ogg_exn_not_enough_data");
+  ogg_exn_internal_error = caml_named_value("ogg_exn_internal_error");
+  init_crc_table();
+  return Val_unit;
+}
 
 static void check(int ret) {
   if (ret < 0)
@@ -88,22 +142,22 @@ static void check(int ret) {
       caml_invalid_argument("opus");
 
     case OPUS_BUFFER_TOO_SMALL:
-      caml_raise_constant(*caml_named_value("opus_exn_buffer_too_small"));
+      caml_raise_constant(*opus_exn_buffer_too_small);
 
     case OPUS_INTERNAL_ERROR:
-      caml_raise_constant(*caml_named_value("opus_exn_internal_error"));
+      caml_raise_constant(*opus_exn_internal_error);
 
     case OPUS_INVALID_PACKET:
-      caml_raise_constant(*caml_named_value("opus_exn_invalid_packet"));
+      caml_raise_constant(*opus_exn_invalid_packet);
 
     case OPUS_UNIMPLEMENTED:
-      caml_raise_constant(*caml_named_value("opus_exn_unimplemented"));
+      caml_raise_constant(*opus_exn_unimplemented);
 
     case OPUS_INVALID_STATE:
-      caml_raise_constant(*caml_named_value("opus_exn_invalid_state"));
+      caml_raise_constant(*opus_exn_invalid_state);
 
     case OPUS_ALLOC_FAIL:
-      caml_raise_constant(*caml_named_value("opus_exn_alloc_fail"));
+      caml_raise_constant(*opus_exn_alloc_fail);
 
     default:
       caml_failwith("Unknown opus error");
@@ -115,13 +169,498 @@ CAMLprim value ocaml_opus_version_string(value unit) {
   CAMLreturn(caml_copy_string(opus_get_version_string()));
 }
 
+/***** Timing ******/
+
+/* Time spent in each call to libopus, when enabled. Frame times are kept in
+ * an histogram with 4 buckets per octave of microseconds. A governor may
+ * collect counters and request a new complexity from another thread than the
+ * one using the handle: all the fields are accessed atomically. */
+#define TIMING_BUCKETS 64
+
+typedef struct timing_t {
+  int enabled;
+  ogg_int64_t total_ns;
+  unsigned int buckets[TIMING_BUCKETS];
+  /* Complexity to apply before the next frame, or -1. */
+  int complexity;
+} timing_t;
+
+#define relaxed_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define relaxed_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define relaxed_exchange(p, v) __atomic_exchange_n(p, v, __ATOMIC_RELAXED)
+#define relaxed_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+
+static void timing_init(timing_t *t) {
+  memset(t, 0, sizeof(timing_t));
+  t->complexity = -1;
+}
+
+/* Take the complexity requested since the last frame, or -1. */
+static int timing_complexity(timing_t *t) {
+  if (relaxed_load(&t->complexity) < 0)
+    return -1;
+  return relaxed_exchange(&t->complexity, -1);
+}
+
+static ogg_int64_t timing_start(timing_t *t) {
+  struct timespec ts;
+
+  if (!relaxed_load(&t->enabled))
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ogg_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timing_stop(timing_t *t, ogg_int64_t start) {
+  struct timespec ts;
+  ogg_int64_t ns, us;
+  int b = 0, idx;
+
+  if (!start || !relaxed_load(&t->enabled))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (ogg_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - start;
+  relaxed_add(&t->total_ns, ns);
+
+  us = ns / 1000;
+  if (us < 4)
+    idx = us;
+  else {
+    while (us >> (b + 1))
+      b++;
+    idx = 4 * (b - 1) + ((us >> (b - 2)) & 3);
+  }
+  if (idx >= TIMING_BUCKETS)
+    idx = TIMING_BUCKETS - 1;
+  relaxed_add(&t->buckets[idx], 1);
+}
+
+/* Add the histogram to [hist], reset it and return the total time in
+ * nanoseconds. */
+static value collect_timing(timing_t *t, value hist) {
+  ogg_int64_t total_ns = relaxed_exchange(&t->total_ns, 0);
+  unsigned int n;
+  int i;
+
+  for (i = 0; i < TIMING_BUCKETS; i++) {
+    n = relaxed_exchange(&t->buckets[i], 0);
+    if (i < Wosize_val(hist))
+      Field(hist, i) = Val_long(Long_val(Field(hist, i)) + n);
+  }
+
+  return Val_long(total_ns);
+}
+
+/***** Loudness ******/
+
+/* EBU R128 (ITU-R BS.1770) loudness meter. Samples are fed to the meter by
+ * the loops converting between interleaved and per-channel buffers so that
+ * they are only read once. Gated loudness and loudness range are computed
+ * from histograms of block energies, with 0.1 LU bins starting at the
+ * -70 LUFS absolute gate. */
+#define METER_BINS 1000
+/* Short-term loudness window, in 100ms sub-blocks. */
+#define METER_SHORT_TERM 30
+/* Taps per phase of the 4x oversampling filter used for true peak. */
+#define METER_TAPS 12
+
+typedef struct meter_chan_t {
+  double weight;
+  /* K-weighting filters' states. */
+  double state[2][2];
+  /* Sum of squared K-weighted samples in the current sub-block. */
+  double energy;
+  double sample_peak;
+  double true_peak;
+  /* Last samples, stored twice to avoid wrapping around. */
+  double history[2 * METER_TAPS];
+  int history_pos;
+} meter_chan_t;
+
+typedef struct meter_t {
+  int channels;
+  int sub_block_len;
+  /* Samples in the current sub-block. */
+  int fill;
+  long sub_blocks;
+  double b[2][3];
+  double a[2][2];
+  double oversampling[4][METER_TAPS];
+  double sub_block_energy[METER_SHORT_TERM];
+  double momentary_energy[METER_BINS];
+  unsigned long momentary_count[METER_BINS];
+  double short_term_energy[METER_BINS];
+  unsigned long short_term_count[METER_BINS];
+  meter_chan_t chans[];
+} meter_t;
+
+/* Channel weights, in Vorbis channel order. */
+static double meter_weight(int channels, int c) {
+  if (channels == 4)
+    return c >= 2 ? 1.41 : 1.0;
+  if (channels < 5)
+    return 1.0;
+  /* LFE comes last. */
+  if (channels >= 6 && c == channels - 1)
+    return 0.0;
+  return c >= 3 ? 1.41 : 1.0;
+}
+
+static meter_t *meter_create(int samplerate, int channels) {
+  meter_t *m = calloc(1, sizeof(meter_t) + channels * sizeof(meter_chan_t));
+  double f0, g, q, k, vh, vb, a0, t;
+  int c, p, n;
+
+  if (m == NULL)
+    return NULL;
+
+  m->channels = channels;
+  m->sub_block_len = samplerate / 10;
+
+  for (c = 0; c < channels; c++)
+    m->chans[c].weight = meter_weight(channels, c);
+
+  /* K-weighting: high shelf followed by a high pass, computed for the
+   * actual samplerate. */
+  f0 = 1681.974450955533;
+  g = 3.999843853973347;
+  q = 0.7071752369554196;
+  k = tan(M_PI * f0 / samplerate);
+  vh = pow(10.0, g / 20.0);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1.0 + k / q + k * k;
+  m->b[0][0] = (vh + vb * k / q + k * k) / a0;
+  m->b[0][1] = 2.0 * (k * k - vh) / a0;
+  m->b[0][2] = (vh - vb * k / q + k * k) / a0;
+  m->a[0][0] = 2.0 * (k * k - 1.0) / a0;
+  m->a[0][1] = (1.0 - k / q + k * k) / a0;
+
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / samplerate);
+  a0 = 1.0 + k / q + k * k;
+  m->b[1][0] = 1.0;
+  m->b[1][1] = -2.0;
+  m->b[1][2] = 1.0;
+  m->a[1][0] = 2.0 * (k * k - 1.0) / a0;
+  m->a[1][1] = (1.0 - k / q + k * k) / a0;
+
+  /* Hann-windowed sinc interpolating at a quarter sample steps. Phase 0 is
+   * the input sample itself. */
+  for (p = 0; p < 4; p++)
+    for (n = 0; n < METER_TAPS; n++) {
+      t = n - METER_TAPS / 2 + p / 4.0;
+      m->oversampling[p][n] =
+          (t == 0 ? 1.0 : sin(M_PI * t) / (M_PI * t)) *
+          0.5 * (1.0 + cos(2.0 * M_PI * t / METER_TAPS));
+    }
+
+  return m;
+}
+
+static inline void meter_add(meter_t *m, int c, double x) {
+  meter_chan_t *mc = &m->chans[c];
+  double y, z, ax;
+  int p, n, pos;
+
+  /* Transposed direct form II biquads. */
+  y = m->b[0][0] * x + mc->state[0][0];
+  mc->state[0][0] = m->b[0][1] * x - m->a[0][0] * y + mc->state[0][1];
+  mc->state[0][1] = m->b[0][2] * x - m->a[0][1] * y;
+  z = m->b[1][0] * y + mc->state[1][0];
+  mc->state[1][0] = m->b[1][1] * y - m->a[1][0] * z + mc->state[1][1];
+  mc->state[1][1] = m->b[1][2] * y - m->a[1][1] * z;
+  mc->energy += z * z;
+
+  ax = fabs(x);
+  if (ax > mc->sample_peak)
+    mc->sample_peak = ax;
+
+  pos = mc->history_pos + 1;
+  if (pos == METER_TAPS)
+    pos = 0;
+  mc->history_pos = pos;
+  mc->history[pos] = mc->history[pos + METER_TAPS] = x;
+
+  for (p = 1; p < 4; p++) {
+    y = 0;
+    for (n = 0; n < METER_TAPS; n++)
+      y += m->oversampling[p][n] * mc->history[pos + METER_TAPS - n];
+    y = fabs(y);
+    if (y > mc->true_peak)
+      mc->true_peak = y;
+  }
+}
+
+static double meter_loudness(double energy) {
+  return -0.691 + 10.0 * log10(energy);
+}
+
+static int meter_bin(double loudness) {
+  int bin;
+
+  if (loudness < -70.0)
+    return 0;
+  bin = (loudness + 70.0) * 10.0;
+  return bin < METER_BINS ? bin : METER_BINS - 1;
+}
+
+static void meter_histogram(double *energy, unsigned long *count, double e) {
+  int bin;
+
+  /* Absolute gate. */
+  if (e <= 0 || meter_loudness(e) < -70.0)
+    return;
+
+  bin = meter_bin(meter_loudness(e));
+  energy[bin] += e;
+  count[bin]++;
+}
+
+static void meter_sub_block(meter_t *m) {
+  double e = 0;
+  int c, i;
+
+  for (c = 0; c < m->channels; c++) {
+    e += m->chans[c].weight * m->chans[c].energy;
+    m->chans[c].energy = 0;
+  }
+  m->sub_block_energy[m->sub_blocks % METER_SHORT_TERM] = e;
+  m->sub_blocks++;
+  m->fill = 0;
+
+  /* 400ms gating blocks, overlapping by 75%. */
+  if (m->sub_blocks >= 4) {
+    for (e = 0, i = 1; i <= 4; i++)
+      e += m->sub_block_energy[(m->sub_blocks - i) % METER_SHORT_TERM];
+    meter_histogram(m->momentary_energy, m->momentary_count,
+                    e / (4.0 * m->sub_block_len));
+  }
+
+  /* 3s short-term blocks, for the loudness range. */
+  if (m->sub_blocks >= METER_SHORT_TERM) {
+    for (e = 0, i = 0; i < METER_SHORT_TERM; i++)
+      e += m->sub_block_energy[i];
+    meter_histogram(m->short_term_energy, m->short_term_count,
+                    e / ((double)METER_SHORT_TERM * m->sub_block_len));
+  }
+}
+
+/* To be called once all the channels of a sample have been added. */
+static inline void meter_next(meter_t *m) {
+  if (++m->fill == m->sub_block_len)
+    meter_sub_block(m);
+}
+
+/* First bin above the relative gate. Returns the number of gated blocks. */
+static unsigned long meter_gate(double *energy, unsigned long *count,
+                                double gate, int *start) {
+  double e = 0;
+  unsigned long n = 0;
+  int bin;
+
+  for (bin = 0; bin < METER_BINS; bin++) {
+    e += energy[bin];
+    n += count[bin];
+  }
+
+  if (n == 0)
+    return 0;
+
+  *start = meter_bin(meter_loudness(e / n) + gate);
+
+  for (n = 0, bin = *start; bin < METER_BINS; bin++)
+    n += count[bin];
+
+  return n;
+}
+
+static double meter_integrated(meter_t *m) {
+  double e = 0;
+  unsigned long n;
+  int bin, start;
+
+  n = meter_gate(m->momentary_energy, m->momentary_count, -10.0, &start);
+  if (n == 0)
+    return -INFINITY;
+
+  for (bin = start; bin < METER_BINS; bin++)
+    e += m->momentary_energy[bin];
+
+  return meter_loudness(e / n);
+}
+
+static double meter_percentile(meter_t *m, int start, unsigned long n,
+                               double p) {
+  unsigned long target = p * (n - 1), acc = 0;
+  int bin;
+
+  for (bin = start; bin < METER_BINS; bin++) {
+    acc += m->short_term_count[bin];
+    if (acc > target)
+      break;
+  }
+
+  return -70.0 + (bin + 0.5) / 10.0;
+}
+
+static double meter_range(meter_t *m) {
+  unsigned long n;
+  int start;
+
+  n = meter_gate(m->short_term_energy, m->short_term_count, -20.0, &start);
+  if (n == 0)
+    return 0;
+
+  return meter_percentile(m, start, n, 0.95) -
+         meter_percentile(m, start, n, 0.10);
+}
+
+/* Returns a Loudness.t record. */
+static value meter_result(meter_t *m) {
+  CAMLparam0();
+  CAMLlocal1(ans);
+  double sample_peak = 0, true_peak = 0;
+  int c;
+
+  for (c = 0; c < m->channels; c++) {
+    if (m->chans[c].sample_peak > sample_peak)
+      sample_peak = m->chans[c].sample_peak;
+    if (m->chans[c].true_peak > true_peak)
+      true_peak = m->chans[c].true_peak;
+  }
+  if (sample_peak > true_peak)
+    true_peak = sample_peak;
+
+  ans = caml_alloc(4 * Double_wosize, Double_array_tag);
+  Store_double_field(ans, 0, meter_integrated(m));
+  Store_double_field(ans, 1, meter_range(m));
+  Store_double_field(ans, 2, 20.0 * log10(true_peak));
+  Store_double_field(ans, 3, 20.0 * log10(sample_peak));
+  CAMLreturn(ans);
+}
+
+/* Conversions between interleaved samples and OCaml buffers. [m] may be
+ * NULL. */
+
+/* Output channel [o] of a sample of [chans] channels, mixed with the
+ * [outputs] x [chans] matrix [mix], if not NULL. */
+static inline float mix_sample(const float *pcm, int chans, const float *mix,
+                               int o) {
+  float x = 0;
+  int c;
+
+  if (mix == NULL)
+    return pcm[o];
+
+  for (c = 0; c < chans; c++)
+    x += mix[o * chans + c] * pcm[c];
+
+  return x;
+}
+
+/* The meter is fed with the decoded channels, before mixing. */
+static void store_pcm(value buf, int ofs, const float *pcm, int chans,
+                      int len, const float *mix, meter_t *m) {
+  int outputs = Wosize_val(buf);
+  int i, c;
+
+  for (i = 0; i < len; i++, pcm += chans) {
+    for (c = 0; c < outputs; c++)
+      Store_double_field(Field(buf, c), ofs + i,
+                         clip(mix_sample(pcm, chans, mix, c)));
+    if (m != NULL) {
+      for (c = 0; c < chans; c++)
+        meter_add(m, c, pcm[c]);
+      meter_next(m);
+    }
+  }
+}
+
+static void store_pcm_ba(value buf, int ofs, const float *pcm, int chans,
+                         int len, const float *mix, meter_t *m) {
+  int outputs = Wosize_val(buf);
+  int i, c;
+
+  for (i = 0; i < len; i++, pcm += chans) {
+    for (c = 0; c < outputs; c++)
+      ((float *)Caml_ba_data_val(Field(buf, c)))[ofs + i] =
+          mix_sample(pcm, chans, mix, c);
+    if (m != NULL) {
+      for (c = 0; c < chans; c++)
+        meter_add(m, c, pcm[c]);
+      meter_next(m);
+    }
+  }
+}
+
+/* Only the first [metered] samples are fed to the meter. */
+static void load_pcm(float *pcm, value buf, int ofs, int len, meter_t *m,
+                     int metered) {
+  int chans = Wosize_val(buf);
+  int i, c;
+  double x;
+
+  for (i = 0; i < len; i++) {
+    for (c = 0; c < chans; c++) {
+      x = clip(Double_field(Field(buf, c), ofs + i));
+      pcm[i * chans + c] = x;
+      if (m != NULL && i < metered)
+        meter_add(m, c, x);
+    }
+    if (m != NULL && i < metered)
+      meter_next(m);
+  }
+}
+
+static void load_pcm_ba(float *pcm, value buf, int ofs, int len, meter_t *m,
+                        int metered) {
+  int chans = Wosize_val(buf);
+  int i, c;
+  float x;
+
+  for (i = 0; i < len; i++) {
+    for (c = 0; c < chans; c++) {
+      x = ((float *)Caml_ba_data_val(Field(buf, c)))[ofs + i];
+      pcm[i * chans + c] = x;
+      if (m != NULL && i < metered)
+        meter_add(m, c, x);
+    }
+    if (m != NULL && i < metered)
+      meter_next(m);
+  }
+}
+
 /***** Decoder ******/
 
-#define Dec_val(v) (*(OpusDecoder **)Data_custom_val(v))
+typedef struct decoder_t {
+  /* NULL once closed. */
+  OpusDecoder *decoder;
+  int channels;
+  /* Samples left to discard at the beginning of the stream. */
+  int pre_skip;
+  timing_t timing;
+  /* NULL unless enabled. */
+  meter_t *meter;
+  /* Output mix, NULL unless set. */
+  float *mix;
+  int mix_outputs;
+  /* Last threaded vectored call using the handle. */
+  unsigned long many_call;
+} decoder_t;
+
+#define Dec_val(v) (*(decoder_t **)Data_custom_val(v))
+#define Dec_handle_val(v) (Dec_val(v)->decoder)
 
 static void finalize_dec(value v) {
-  OpusDecoder *dec = Dec_val(v);
-  opus_decoder_destroy(dec);
+  decoder_t *dec = Dec_val(v);
+  if (dec->decoder != NULL)
+    opus_decoder_destroy(dec->decoder);
+  free(dec->meter);
+  free(dec->mix);
+  free(dec);
 }
 
 static struct custom_operations dec_ops = {
@@ -129,22 +668,50 @@ static struct custom_operations dec_ops = {
     custom_compare_default,   custom_hash_default,
     custom_serialize_default, custom_deserialize_default};
 
-CAMLprim value ocaml_opus_decoder_create(value _sr, value _chans) {
+CAMLprim value ocaml_opus_decoder_create(value _sr, value _chans,
+                                         value _pre_skip) {
   CAMLparam0();
   CAMLlocal1(ans);
   opus_int32 sr = Int_val(_sr);
   int chans = Int_val(_chans);
   int ret = 0;
-  OpusDecoder *dec;
-
-  dec = opus_decoder_create(sr, chans, &ret);
+  decoder_t *dec = malloc(sizeof(decoder_t));
+  if (dec == NULL)
+    caml_raise_out_of_memory();
 
-  check(ret);
-  ans = caml_alloc_custom(&dec_ops, sizeof(OpusDecoder *), 0, 1);
+  dec->channels = chans;
+  dec->pre_skip = Int_val(_pre_skip);
+  timing_init(&dec->timing);
+  dec->meter = NULL;
+  dec->mix = NULL;
+  dec->mix_outputs = 0;
+  dec->many_call = 0;
+  dec->decoder = opus_decoder_create(sr, chans, &ret);
+
+  if (ret < 0) {
+    free(dec);
+    check(ret);
+  }
+  /* Let the GC know about the actual size of the decoder's state so that
+   * finalizers are run in a timely manner. */
+  ans = caml_alloc_custom_mem(&dec_ops, sizeof(decoder_t *),
+                              sizeof(decoder_t) + opus_decoder_get_size(chans));
   Dec_val(ans) = dec;
   CAMLreturn(ans);
 }
 
+/* The state is used without the runtime lock by decoding functions: callers
+ * must ensure that no other thread is using the handle. */
+CAMLprim value ocaml_opus_decoder_close(value _dec) {
+  CAMLparam1(_dec);
+  decoder_t *dec = Dec_val(_dec);
+  if (dec->decoder != NULL) {
+    opus_decoder_destroy(dec->decoder);
+    dec->decoder = NULL;
+  }
+  CAMLreturn(Val_unit);
+}
+
 CAMLprim value ocaml_opus_packet_check_header(value packet) {
   CAMLparam1(packet);
   ogg_packet *op = Packet_val(packet);
@@ -156,171 +723,281 @@ CAMLprim value ocaml_opus_packet_check_header(value packet) {
   CAMLreturn(Val_bool(ans));
 }
 
-CAMLprim value ocaml_opus_decoder_channels(value packet) {
-  CAMLparam1(packet);
+static unsigned char *header_data(value packet) {
   ogg_packet *op = Packet_val(packet);
-  uint8_t *data = op->packet;
-  uint8_t version = *(data + 8);
 
-  if (op->bytes <= 10 || memcmp(op->packet, "OpusHead", 8))
+  if (op->bytes < 19 || memcmp(op->packet, "OpusHead", 8))
     caml_invalid_argument("Wrong header data.");
 
-  if (version != 1)
+  if (op->packet[8] != 1)
     caml_invalid_argument("Wrong header version.");
 
-  uint8_t ret = *(data + 9);
+  return op->packet;
+}
 
-  CAMLreturn(Val_int(ret));
+CAMLprim value ocaml_opus_decoder_channels(value packet) {
+  CAMLparam1(packet);
+  unsigned char *data = header_data(packet);
+  CAMLreturn(Val_int(data[9]));
 }
 
-CAMLprim value ocaml_opus_comments(value packet) {
+CAMLprim value ocaml_opus_header_pre_skip(value packet) {
+  CAMLparam1(packet);
+  unsigned char *data = header_data(packet);
+  CAMLreturn(Val_int(data[10] | (data[11] << 8)));
+}
+
+CAMLprim value ocaml_opus_header_gain(value packet) {
   CAMLparam1(packet);
+  unsigned char *data = header_data(packet);
+  CAMLreturn(Val_int((opus_int16)(data[16] | (data[17] << 8))));
+}
+
+/* Copy of a header packet with a different output gain. */
+CAMLprim value ocaml_opus_header_set_gain(value packet, value _gain) {
+  CAMLparam2(packet, _gain);
+  CAMLlocal1(ans);
+  ogg_packet op = *Packet_val(packet);
+  unsigned char *data = header_data(packet);
+  intnat g = Long_val(_gain);
+  /* Clamped to the range of the field, as r128_gain. */
+  opus_int16 gain = g < -32768 ? -32768 : g > 32767 ? 32767 : g;
+
+  op.packet = malloc(op.bytes);
+  if (op.packet == NULL)
+    caml_raise_out_of_memory();
+
+  memcpy(op.packet, data, op.bytes);
+  op.packet[16] = gain & 0xff;
+  op.packet[17] = (gain >> 8) & 0xff;
+
+  ans = value_of_packet(&op);
+  free(op.packet);
+  CAMLreturn(ans);
+}
+
+/* [data] must not be moved by the GC. */
+static value parse_comments(unsigned char *data, long bytes) {
+  CAMLparam0();
   CAMLlocal2(ans, comments);
-  ogg_packet *op = Packet_val(packet);
-  if (!(op->bytes >= 8 && !memcmp(op->packet, "OpusTags", 8)))
+  if (!(bytes >= 8 && !memcmp(data, "OpusTags", 8)))
     check(OPUS_INVALID_PACKET);
   ans = caml_alloc_tuple(2);
 
   int off = 8;
   /* Vendor */
 
-  if (off + 4 > op->bytes)
+  if (off + 4 > bytes)
     check(OPUS_INVALID_PACKET);
 
-  opus_int32 vendor_length =
-      int32le_to_native(*((opus_int32 *)(op->packet + off)));
+  opus_int32 vendor_length = int32le_to_native(*((opus_int32 *)(data + off)));
   off += 4;
 
-  if (off + vendor_length > op->bytes)
+  if (off + vendor_length > bytes)
     check(OPUS_INVALID_PACKET);
 
   Store_field(ans, 0, caml_alloc_string(vendor_length));
-  memcpy(Bytes_val(Field(ans, 0)), op->packet + off, vendor_length);
+  memcpy(Bytes_val(Field(ans, 0)), data + off, vendor_length);
 
   off += vendor_length;
 
   /* Comments */
 
-  if (off + 4 > op->bytes)
+  if (off + 4 > bytes)
     check(OPUS_INVALID_PACKET);
 
   opus_int32 comments_length =
-      int32le_to_native(*((opus_int32 *)(op->packet + off)));
+      int32le_to_native(*((opus_int32 *)(data + off)));
   off += 4;
 
   comments = caml_alloc_tuple(comments_length);
   Store_field(ans, 1, comments);
   opus_int32 i, len;
   for (i = 0; i < comments_length; i++) {
-    if (off + 4 > op->bytes)
+    if (off + 4 > bytes)
       check(OPUS_INVALID_PACKET);
 
-    len = int32le_to_native(*((opus_int32 *)(op->packet + off)));
+    len = int32le_to_native(*((opus_int32 *)(data + off)));
     off += 4;
 
-    if (off + len > op->bytes)
+    if (off + len > bytes)
       check(OPUS_INVALID_PACKET);
 
     Store_field(comments, i, caml_alloc_string(len));
-    memcpy(Bytes_val(Field(comments, i)), op->packet + off, len);
+    memcpy(Bytes_val(Field(comments, i)), data + off, len);
     off += len;
   }
 
   CAMLreturn(ans);
 }
 
-static opus_int32 bandwidth_of_value(value v) {
-  if (v == get_var(Auto))
-    return OPUS_AUTO;
-  if (v == get_var(Narrow_band))
-    return OPUS_BANDWIDTH_NARROWBAND;
-  if (v == get_var(Medium_band))
-    return OPUS_BANDWIDTH_MEDIUMBAND;
-  if (v == get_var(Wide_band))
-    return OPUS_BANDWIDTH_WIDEBAND;
-  if (v == get_var(Super_wide_band))
-    return OPUS_BANDWIDTH_SUPERWIDEBAND;
-  if (v == get_var(Full_band))
-    return OPUS_BANDWIDTH_FULLBAND;
+CAMLprim value ocaml_opus_comments(value packet) {
+  CAMLparam1(packet);
+  ogg_packet *op = Packet_val(packet);
+  CAMLreturn(parse_comments(op->packet, op->bytes));
+}
+
+/* Decoder controls. */
+generic_ctls(decoder, Dec_handle_val, opus_decoder_ctl);
+set_ctl(decoder, set_gain, Dec_handle_val, opus_decoder_ctl, OPUS_SET_GAIN);
+get_ctl(decoder, get_gain, Dec_handle_val, opus_decoder_ctl, OPUS_GET_GAIN,
+        opus_int32);
+/* Only supported by recent versions of libopus. */
+set_ctl(decoder, set_complexity, Dec_handle_val, opus_decoder_ctl,
+        OPUS_SET_COMPLEXITY);
+
+CAMLprim value ocaml_opus_decoder_set_timing(value _dec, value _enabled) {
+  relaxed_store(&Dec_val(_dec)->timing.enabled, Bool_val(_enabled));
+  return Val_unit;
+}
 
-  caml_failwith("Unknown opus error");
+CAMLprim value ocaml_opus_decoder_collect_timing(value _dec, value hist) {
+  return collect_timing(&Dec_val(_dec)->timing, hist);
 }
 
-static value value_of_bandwidth(opus_int32 a) {
-  switch (a) {
-  case OPUS_AUTO:
-    return get_var(Auto);
-  case OPUS_BANDWIDTH_NARROWBAND:
-    return get_var(Narrow_band);
-  case OPUS_BANDWIDTH_MEDIUMBAND:
-    return get_var(Medium_band);
-  case OPUS_BANDWIDTH_WIDEBAND:
-    return get_var(Wide_band);
-  case OPUS_BANDWIDTH_SUPERWIDEBAND:
-    return get_var(Super_wide_band);
-  case OPUS_BANDWIDTH_FULLBAND:
-    return get_var(Full_band);
-  default:
-    caml_failwith("Unknown opus error");
-  }
-}
-
-CAMLprim value ocaml_opus_decoder_ctl(value ctl, value _dec) {
-  CAMLparam2(_dec, ctl);
-  CAMLlocal2(tag, v);
-  OpusDecoder *dec = Dec_val(_dec);
-  if (Is_long(ctl)) {
-    // Only ctl without argument here is reset state..
-    opus_decoder_ctl(dec, OPUS_RESET_STATE);
-    CAMLreturn(Val_unit);
-  } else {
-    v = Field(ctl, 1);
-    tag = Field(ctl, 0);
-
-    /* Generic controls. */
-    get_ctl(tag, Get_final_range, dec, opus_decoder_ctl, OPUS_GET_FINAL_RANGE,
-            v, opus_uint32);
-    get_ctl(tag, Get_pitch, dec, opus_decoder_ctl, OPUS_GET_PITCH, v,
-            opus_int32);
-    get_value_ctl(tag, Get_bandwidth, dec, opus_decoder_ctl, OPUS_GET_BANDWIDTH,
-                  v, opus_int32, value_of_bandwidth);
-    set_ctl(tag, Set_lsb_depth, dec, opus_decoder_ctl, OPUS_SET_LSB_DEPTH, v);
-    get_ctl(tag, Get_lsb_depth, dec, opus_decoder_ctl, OPUS_GET_LSB_DEPTH, v,
-            opus_int32);
-#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
-    set_ctl(tag, Set_phase_inversion_disabled, dec, opus_decoder_ctl,
-            OPUS_SET_PHASE_INVERSION_DISABLED, v);
-#endif
+/* Complexity is set by the thread decoding with the handle, before its next
+ * frame. */
+CAMLprim value ocaml_opus_decoder_request_complexity(value _dec, value _n) {
+  decoder_t *dec = Dec_val(_dec);
+  if (dec->decoder == NULL)
+    return Val_int(OPUS_INVALID_STATE);
+  relaxed_store(&dec->timing.complexity, Int_val(_n));
+  return Val_int(OPUS_OK);
+}
 
-    /* Decoder controls. */
-    get_ctl(tag, Get_gain, dec, opus_decoder_ctl, OPUS_GET_GAIN, v, opus_int32);
-    set_ctl(tag, Set_gain, dec, opus_decoder_ctl, OPUS_SET_GAIN, v);
+/* Only supported by recent versions of libopus, errors are ignored. */
+static void decoder_apply_complexity(decoder_t *dec) {
+  int n = timing_complexity(&dec->timing);
+  if (n >= 0)
+    opus_decoder_ctl(dec->decoder, OPUS_SET_COMPLEXITY(n));
+}
+
+/* (Re)start measuring the loudness of decoded samples. */
+CAMLprim value ocaml_opus_decoder_enable_loudness(value _dec) {
+  CAMLparam1(_dec);
+  decoder_t *dec = Dec_val(_dec);
+  opus_int32 sr;
+
+  if (dec->decoder == NULL)
+    check(OPUS_INVALID_STATE);
+
+  check(opus_decoder_ctl(dec->decoder, OPUS_GET_SAMPLE_RATE(&sr)));
+
+  free(dec->meter);
+  dec->meter = meter_create(sr, dec->channels);
+  if (dec->meter == NULL)
+    caml_raise_out_of_memory();
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_opus_decoder_loudness(value _dec) {
+  CAMLparam1(_dec);
+  decoder_t *dec = Dec_val(_dec);
+
+  if (dec->meter == NULL)
+    caml_invalid_argument("Loudness measurement is not enabled.");
+
+  CAMLreturn(meter_result(dec->meter));
+}
+
+/* Decoders produce their own number of channels, whatever the packets'.
+ * Output buffers with a different number of channels are filled through a
+ * mixing matrix. */
+#define MIX_MAX_OUTPUTS 255
+
+/* Matrix used for [outputs] channels. When not set, it is computed into
+ * [tmp]: decoded mono is copied to every output, decoded channels are
+ * averaged to mono and otherwise mapped one to one. Returns NULL when no
+ * mixing is needed. */
+static const float *decoder_mix(decoder_t *dec, int outputs, float *tmp) {
+  int chans = dec->channels;
+  int o, c;
+
+  if (dec->mix != NULL) {
+    if (outputs != dec->mix_outputs)
+      caml_invalid_argument("Wrong number of channels.");
+    return dec->mix;
   }
 
-  caml_failwith("Unknown opus error");
+  if (outputs == chans)
+    return NULL;
+
+  if (outputs > MIX_MAX_OUTPUTS)
+    caml_invalid_argument("Wrong number of channels.");
+
+  for (o = 0; o < outputs; o++)
+    for (c = 0; c < chans; c++)
+      tmp[o * chans + c] =
+          chans == 1 ? 1.0 : outputs == 1 ? 1.0 / chans : o == c;
+
+  return tmp;
+}
+
+/* [matrix] has a row per output channel and a column per decoded channel.
+ * An empty matrix restores the default mix. */
+CAMLprim value ocaml_opus_decoder_set_mix(value _dec, value matrix) {
+  CAMLparam2(_dec, matrix);
+  decoder_t *dec = Dec_val(_dec);
+  int outputs = Wosize_val(matrix);
+  float *mix = NULL;
+  int o, c;
+
+  if (outputs > MIX_MAX_OUTPUTS)
+    caml_invalid_argument("Too many output channels.");
+
+  for (o = 0; o < outputs; o++)
+    if (Wosize_val(Field(matrix, o)) / Double_wosize != dec->channels)
+      caml_invalid_argument("Wrong number of decoded channels.");
+
+  if (outputs > 0) {
+    mix = malloc(outputs * dec->channels * sizeof(float));
+    if (mix == NULL)
+      caml_raise_out_of_memory();
+
+    for (o = 0; o < outputs; o++)
+      for (c = 0; c < dec->channels; c++)
+        mix[o * dec->channels + c] = Double_field(Field(matrix, o), c);
+  }
+
+  free(dec->mix);
+  dec->mix = mix;
+  dec->mix_outputs = outputs;
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_opus_decoder_decoded_channels(value _dec) {
+  return Val_int(Dec_val(_dec)->channels);
 }
 
 CAMLprim value ocaml_opus_decoder_decode_float(value _dec, value _os, value buf,
                                                value _ofs, value _len,
                                                value _fec) {
   CAMLparam3(_dec, _os, buf);
-  CAMLlocal1(chan);
   ogg_stream_state *os = Stream_state_val(_os);
   ogg_packet op;
-  OpusDecoder *dec = Dec_val(_dec);
+  decoder_t *handler = Dec_val(_dec);
+  OpusDecoder *dec = handler->decoder;
   int decode_fec = Int_val(_fec);
 
+  if (dec == NULL)
+    check(OPUS_INVALID_STATE);
+
   int ofs = Int_val(_ofs);
   int len = Int_val(_len);
   int total_samples = 0;
   int ret;
 
-  int chans = Wosize_val(buf);
+  float mix_tmp[MIX_MAX_OUTPUTS * 2];
+  const float *mix = decoder_mix(handler, Wosize_val(buf), mix_tmp);
+  int chans = handler->channels;
   float *pcm = malloc(chans * len * sizeof(float));
   if (pcm == NULL)
     caml_raise_out_of_memory();
 
-  int i, c;
+  int skip;
+  ogg_int64_t start;
 
   while (total_samples < len) {
     ret = ogg_stream_packetout(os, &op);
@@ -331,37 +1008,39 @@ CAMLprim value ocaml_opus_decoder_decode_float(value _dec, value _os, value buf,
      *    decoded if > 0 and raise
      *    Ogg_not_enough_data otherwise
      * -1: out of sync */
-    if (ret == -1)
-      caml_raise_constant(*caml_named_value("ogg_exn_out_of_sync"));
+    if (ret == -1) {
+      free(pcm);
+      caml_raise_constant(*ogg_exn_out_of_sync);
+    }
 
     if (ret == 0) {
       free(pcm);
       if (total_samples > 0) {
         CAMLreturn(Val_int(total_samples));
       } else {
-        caml_raise_constant(*caml_named_value("ogg_exn_not_enough_data"));
+        caml_raise_constant(*ogg_exn_not_enough_data);
       }
     }
 
-    if (chans != opus_packet_get_nb_channels(op.packet))
-      caml_invalid_argument("Wrong number of channels.");
-
     caml_release_runtime_system();
+    decoder_apply_complexity(handler);
+    start = timing_start(&handler->timing);
     ret = opus_decode_float(dec, op.packet, op.bytes, pcm, len, decode_fec);
+    timing_stop(&handler->timing, start);
     caml_acquire_runtime_system();
 
     if (ret < 0) {
       free(pcm);
       check(ret);
     }
-    for (c = 0; c < chans; c++) {
-      chan = Field(buf, c);
-      for (i = 0; i < ret; i++)
-        Store_double_field(chan, ofs + total_samples + i,
-                           clip(pcm[i * chans + c]));
-    }
-    total_samples += ret;
-    len -= ret;
+    /* Discard pre-skip samples. */
+    skip = handler->pre_skip < ret ? handler->pre_skip : ret;
+    handler->pre_skip -= skip;
+
+    store_pcm(buf, ofs + total_samples, pcm + skip * chans, chans, ret - skip,
+              mix, handler->meter);
+    total_samples += ret - skip;
+    len -= ret - skip;
   }
 
   free(pcm);
@@ -377,23 +1056,29 @@ CAMLprim value ocaml_opus_decoder_decode_float_ba(value _dec, value _os,
                                                   value buf, value _ofs,
                                                   value _len, value _fec) {
   CAMLparam3(_dec, _os, buf);
-  CAMLlocal1(chan);
   ogg_stream_state *os = Stream_state_val(_os);
   ogg_packet op;
-  OpusDecoder *dec = Dec_val(_dec);
+  decoder_t *handler = Dec_val(_dec);
+  OpusDecoder *dec = handler->decoder;
   int decode_fec = Int_val(_fec);
 
+  if (dec == NULL)
+    check(OPUS_INVALID_STATE);
+
   int ofs = Int_val(_ofs);
   int len = Int_val(_len);
   int total_samples = 0;
   int ret;
 
-  int chans = Wosize_val(buf);
+  float mix_tmp[MIX_MAX_OUTPUTS * 2];
+  const float *mix = decoder_mix(handler, Wosize_val(buf), mix_tmp);
+  int chans = handler->channels;
   float *pcm = malloc(chans * len * sizeof(float));
   if (pcm == NULL)
     caml_raise_out_of_memory();
 
-  int i, c;
+  int skip;
+  ogg_int64_t start;
 
   while (total_samples < len) {
     ret = ogg_stream_packetout(os, &op);
@@ -404,37 +1089,39 @@ CAMLprim value ocaml_opus_decoder_decode_float_ba(value _dec, value _os,
      *    decoded if > 0 and raise
      *    Ogg_not_enough_data otherwise
      * -1: out of sync */
-    if (ret == -1)
-      caml_raise_constant(*caml_named_value("ogg_exn_out_of_sync"));
+    if (ret == -1) {
+      free(pcm);
+      caml_raise_constant(*ogg_exn_out_of_sync);
+    }
 
     if (ret == 0) {
       free(pcm);
       if (total_samples > 0) {
         CAMLreturn(Val_int(total_samples));
       } else {
-        caml_raise_constant(*caml_named_value("ogg_exn_not_enough_data"));
+        caml_raise_constant(*ogg_exn_not_enough_data);
       }
     }
 
-    if (chans != opus_packet_get_nb_channels(op.packet))
-      caml_invalid_argument("Wrong number of channels.");
-
     caml_release_runtime_system();
+    decoder_apply_complexity(handler);
+    start = timing_start(&handler->timing);
     ret = opus_decode_float(dec, op.packet, op.bytes, pcm, len, decode_fec);
+    timing_stop(&handler->timing, start);
     caml_acquire_runtime_system();
 
     if (ret < 0) {
       free(pcm);
       check(ret);
     }
-    for (c = 0; c < chans; c++) {
-      chan = Field(buf, c);
-      for (i = 0; i < ret; i++)
-        ((float *)Caml_ba_data_val(chan))[ofs + total_samples + i] =
-            pcm[i * chans + c];
-    }
-    total_samples += ret;
-    len -= ret;
+    /* Discard pre-skip samples. */
+    skip = handler->pre_skip < ret ? handler->pre_skip : ret;
+    handler->pre_skip -= skip;
+
+    store_pcm_ba(buf, ofs + total_samples, pcm + skip * chans, chans,
+                 ret - skip, mix, handler->meter);
+    total_samples += ret - skip;
+    len -= ret - skip;
   }
 
   free(pcm);
@@ -448,18 +1135,42 @@ CAMLprim value ocaml_opus_decoder_decode_float_ba_byte(value *argv, int argn) {
 
 /***** Encoder *****/
 
+/* Splices are faded over 2.5ms. */
+#define FADE_MAX (48000 / 400)
+
 typedef struct encoder_t {
+  /* NULL once closed. */
   OpusEncoder *encoder;
   int samplerate_ratio;
+  /* Pre-skip, in samples at 48kHz. */
+  int pre_skip;
+  /* Number of input samples encoded so far, at 48kHz. */
+  ogg_int64_t samples;
   ogg_int64_t granulepos;
   ogg_int64_t packetno;
+  int channels;
+  /* Input samples may still be held in the encoder's delay. */
+  int buffered;
+  /* Last bitrate set, OPUS_GET_BITRATE returns the actual one. */
+  opus_int32 bitrate;
+  timing_t timing;
+  /* NULL unless enabled. */
+  meter_t *meter;
+  /* Last threaded vectored call using the handle. */
+  unsigned long many_call;
+  /* Last input samples, interleaved, and number of samples left to fade in
+   * after a splice, see Cache. */
+  float tail[FADE_MAX * 2];
+  int fade_in;
 } encoder_t;
 
 #define Enc_val(v) (*(encoder_t **)Data_custom_val(v))
 
 static void finalize_enc(value v) {
   encoder_t *enc = Enc_val(v);
-  opus_encoder_destroy(enc->encoder);
+  if (enc->encoder != NULL)
+    opus_encoder_destroy(enc->encoder);
+  free(enc->meter);
   free(enc);
 }
 
@@ -479,20 +1190,7 @@ static opus_int32 application_of_value(value v) {
   caml_failwith("Unknown opus error");
 }
 
-static value value_of_application(opus_int32 a) {
-  switch (a) {
-  case OPUS_APPLICATION_VOIP:
-    return get_var(Voip);
-  case OPUS_APPLICATION_AUDIO:
-    return get_var(Audio);
-  case OPUS_APPLICATION_RESTRICTED_LOWDELAY:
-    return get_var(Restricted_lowdelay);
-  default:
-    caml_failwith("Unknown opus error");
-  }
-}
-
-static unsigned char header_packet[19] = {
+static const unsigned char header_template[19] = {
     /* Identifier. */
     'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',
     /* version, channels count, pre-skip (16 bits, unsigned,
@@ -504,10 +1202,12 @@ static unsigned char header_packet[19] = {
      * stream count (always 0 in this implementation) */
     0, 0, 0};
 
-static void pack_header(ogg_packet *op, opus_int32 sr, int channels,
-                        opus_int16 pre_skip, opus_int16 gain) {
-  op->bytes = sizeof(header_packet);
-  op->packet = header_packet;
+/* [data] must hold at least sizeof(header_template) bytes. */
+static void pack_header(ogg_packet *op, unsigned char *data, opus_int32 sr,
+                        int channels, opus_int16 pre_skip, opus_int16 gain) {
+  memcpy(data, header_template, sizeof(header_template));
+  op->bytes = sizeof(header_template);
+  op->packet = data;
 
   /* Now fill data. */
   op->packet[9] = channels;
@@ -567,6 +1267,17 @@ static void pack_comments(ogg_packet *op, char *vendor, value comments) {
   op->packetno = 1;
 }
 
+CAMLprim value ocaml_opus_comments_packet(value vendor, value comments) {
+  CAMLparam2(vendor, comments);
+  CAMLlocal1(ans);
+  ogg_packet op;
+
+  pack_comments(&op, (char *)String_val(vendor), comments);
+  ans = value_of_packet(&op);
+  free(op.packet);
+  CAMLreturn(ans);
+}
+
 CAMLprim value ocaml_opus_encoder_create(value _skip, value _comments,
                                          value _gain, value _sr, value _chans,
                                          value _application) {
@@ -576,26 +1287,55 @@ CAMLprim value ocaml_opus_encoder_create(value _skip, value _comments,
   int chans = Int_val(_chans);
   int ret = 0;
   int app = application_of_value(_application);
+  opus_int32 lookahead;
+
+  ogg_packet comments;
+  pack_comments(&comments, "ocaml-opus by the Savonet Team.", _comments);
+
   encoder_t *enc = malloc(sizeof(encoder_t));
-  if (enc == NULL)
+  if (enc == NULL) {
+    free(comments.packet);
     caml_raise_out_of_memory();
+  }
   /* First encoded packet is the third one. */
   enc->packetno = 1;
   enc->granulepos = 0;
+  enc->samples = 0;
+  enc->channels = chans;
+  enc->buffered = 0;
+  timing_init(&enc->timing);
+  enc->meter = NULL;
+  enc->many_call = 0;
+  enc->bitrate = OPUS_AUTO;
+  memset(enc->tail, 0, sizeof(enc->tail));
+  enc->fade_in = 0;
   /* Value samplerates are: 48000, 24000, 16000, 12000, 8000
    * so this value is always an integer. */
   enc->samplerate_ratio = 48000 / sr;
 
-  ogg_packet header;
-  pack_header(&header, sr, chans, Int_val(_skip), Int_val(_gain));
+  enc->encoder = opus_encoder_create(sr, chans, app, &ret);
 
-  ogg_packet comments;
-  pack_comments(&comments, "ocaml-opus by the Savonet Team.", _comments);
+  if (ret < 0) {
+    free(comments.packet);
+    free(enc);
+    check(ret);
+  }
 
-  enc->encoder = opus_encoder_create(sr, chans, app, &ret);
+  /* Default pre-skip is the encoder's lookahead. */
+  if (Is_block(_skip))
+    enc->pre_skip = Int_val(Field(_skip, 0));
+  else {
+    opus_encoder_ctl(enc->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+    enc->pre_skip = lookahead * enc->samplerate_ratio;
+  }
 
-  check(ret);
-  _enc = caml_alloc_custom(&enc_ops, sizeof(encoder_t *), 0, 1);
+  ogg_packet header;
+  unsigned char header_data[sizeof(header_template)];
+  pack_header(&header, header_data, sr, chans, enc->pre_skip, Int_val(_gain));
+  /* Let the GC know about the actual size of the encoder's state so that
+   * finalizers are run in a timely manner. */
+  _enc = caml_alloc_custom_mem(&enc_ops, sizeof(encoder_t *),
+                               sizeof(encoder_t) + opus_encoder_get_size(chans));
   Enc_val(_enc) = enc;
 
   ans = caml_alloc_tuple(3);
@@ -614,153 +1354,241 @@ CAMLprim value ocaml_opus_encoder_create_byte(value *argv, int argn) {
                                    argv[5]);
 }
 
-static opus_int32 bitrate_of_value(value v) {
-  if (Is_long(v)) {
-    if (v == get_var(Auto))
-      return OPUS_AUTO;
-    if (v == get_var(Bitrate_max))
-      return OPUS_BITRATE_MAX;
-  } else {
-    if (Field(v, 0) == get_var(Bitrate))
-      return Int_val(Field(v, 1));
+/* Same as ocaml_opus_decoder_close. */
+CAMLprim value ocaml_opus_encoder_close(value _enc) {
+  CAMLparam1(_enc);
+  encoder_t *handler = Enc_val(_enc);
+  if (handler->encoder != NULL) {
+    opus_encoder_destroy(handler->encoder);
+    handler->encoder = NULL;
   }
+  CAMLreturn(Val_unit);
+}
 
-  caml_failwith("Unknown opus error");
+/* Encoder controls. */
+#define Enc_handle_val(v) (Enc_val(v)->encoder)
+
+generic_ctls(encoder, Enc_handle_val, opus_encoder_ctl);
+set_ctl(encoder, set_complexity, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_COMPLEXITY);
+get_ctl(encoder, get_complexity, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_COMPLEXITY, opus_int32);
+
+CAMLprim value ocaml_opus_encoder_set_bitrate(value _enc, value _v) {
+  encoder_t *enc = Enc_val(_enc);
+  int ret;
+  if (enc->encoder == NULL)
+    return Val_int(OPUS_INVALID_STATE);
+  ret = opus_encoder_ctl(enc->encoder, OPUS_SET_BITRATE(Int_val(_v)));
+  if (ret == OPUS_OK)
+    enc->bitrate = Int_val(_v);
+  return Val_int(ret);
 }
 
-CAMLprim value value_of_bitrate(opus_int32 a) {
-  CAMLparam0();
-  CAMLlocal1(ret);
-  switch (a) {
-  case OPUS_AUTO:
-    CAMLreturn(get_var(Auto));
-  case OPUS_BITRATE_MAX:
-    CAMLreturn(get_var(Voice));
-  default:
-    ret = caml_alloc_tuple(2);
-    Store_field(ret, 0, get_var(Bitrate));
-    Store_field(ret, 1, Val_int(a));
-    CAMLreturn(ret);
-  }
-}
-
-static opus_int32 signal_of_value(value v) {
-  if (v == get_var(Auto))
-    return OPUS_AUTO;
-  if (v == get_var(Voice))
-    return OPUS_SIGNAL_VOICE;
-  if (v == get_var(Music))
-    return OPUS_SIGNAL_MUSIC;
+CAMLprim value ocaml_opus_encoder_requested_bitrate(value _enc) {
+  return Val_int(Enc_val(_enc)->bitrate);
+}
 
-  caml_failwith("Unknown opus error");
+get_ctl(encoder, get_bitrate, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_BITRATE, opus_int32);
+set_ctl(encoder, set_vbr, Enc_handle_val, opus_encoder_ctl, OPUS_SET_VBR);
+get_ctl(encoder, get_vbr, Enc_handle_val, opus_encoder_ctl, OPUS_GET_VBR,
+        opus_int32);
+set_ctl(encoder, set_vbr_constraint, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_VBR_CONSTRAINT);
+get_ctl(encoder, get_vbr_constraint, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_VBR_CONSTRAINT, opus_int32);
+set_ctl(encoder, set_force_channels, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_FORCE_CHANNELS);
+get_ctl(encoder, get_force_channels, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_FORCE_CHANNELS, opus_int32);
+set_ctl(encoder, set_max_bandwidth, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_MAX_BANDWIDTH);
+get_ctl(encoder, get_max_bandwidth, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_MAX_BANDWIDTH, opus_int32);
+set_ctl(encoder, set_bandwidth, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_BANDWIDTH);
+set_ctl(encoder, set_signal, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_SIGNAL);
+get_ctl(encoder, get_signal, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_SIGNAL, opus_int32);
+set_ctl(encoder, set_application, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_APPLICATION);
+get_ctl(encoder, get_application, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_APPLICATION, opus_int32);
+get_ctl(encoder, get_samplerate, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_SAMPLE_RATE, opus_int32);
+get_ctl(encoder, get_lookahead, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_LOOKAHEAD, opus_int32);
+set_ctl(encoder, set_inband_fec, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_INBAND_FEC);
+get_ctl(encoder, get_inband_fec, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_INBAND_FEC, opus_int32);
+set_ctl(encoder, set_packet_loss_perc, Enc_handle_val, opus_encoder_ctl,
+        OPUS_SET_PACKET_LOSS_PERC);
+get_ctl(encoder, get_packet_loss_perc, Enc_handle_val, opus_encoder_ctl,
+        OPUS_GET_PACKET_LOSS_PERC, opus_int32);
+set_ctl(encoder, set_dtx, Enc_handle_val, opus_encoder_ctl, OPUS_SET_DTX);
+get_ctl(encoder, get_dtx, Enc_handle_val, opus_encoder_ctl, OPUS_GET_DTX,
+        opus_int32);
+
+CAMLprim value ocaml_opus_encoder_set_timing(value _enc, value _enabled) {
+  relaxed_store(&Enc_val(_enc)->timing.enabled, Bool_val(_enabled));
+  return Val_unit;
 }
 
-static value value_of_signal(opus_int32 a) {
-  switch (a) {
-  case OPUS_AUTO:
-    return get_var(Auto);
-  case OPUS_SIGNAL_VOICE:
-    return get_var(Voice);
-  case OPUS_SIGNAL_MUSIC:
-    return get_var(Music);
-  default:
-    caml_failwith("Unknown opus error");
-  }
+CAMLprim value ocaml_opus_encoder_collect_timing(value _enc, value hist) {
+  return collect_timing(&Enc_val(_enc)->timing, hist);
 }
 
-CAMLprim value ocaml_opus_encoder_ctl(value ctl, value _enc) {
-  CAMLparam2(_enc, ctl);
-  CAMLlocal2(tag, v);
-  encoder_t *handler = Enc_val(_enc);
-  OpusEncoder *enc = handler->encoder;
-  if (Is_long(ctl)) {
-    // Only ctl without argument here is reset state..
-    opus_encoder_ctl(enc, OPUS_RESET_STATE);
-    CAMLreturn(Val_unit);
-  } else {
-    v = Field(ctl, 1);
-    tag = Field(ctl, 0);
-
-    /* Generic controls. */
-    get_ctl(tag, Get_final_range, enc, opus_encoder_ctl, OPUS_GET_FINAL_RANGE,
-            v, opus_uint32);
-    get_ctl(tag, Get_pitch, enc, opus_encoder_ctl, OPUS_GET_PITCH, v,
-            opus_int32);
-    get_value_ctl(tag, Get_bandwidth, enc, opus_encoder_ctl, OPUS_GET_BANDWIDTH,
-                  v, opus_int32, value_of_bandwidth);
-    set_ctl(tag, Set_lsb_depth, enc, opus_encoder_ctl, OPUS_SET_LSB_DEPTH, v);
-    get_ctl(tag, Get_lsb_depth, enc, opus_encoder_ctl, OPUS_GET_LSB_DEPTH, v,
-            opus_int32);
-#ifdef OPUS_SET_PHASE_INVERSION_DISABLED
-    set_ctl(tag, Set_phase_inversion_disabled, enc, opus_encoder_ctl,
-            OPUS_SET_PHASE_INVERSION_DISABLED, v);
-#endif
+CAMLprim value ocaml_opus_encoder_request_complexity(value _enc, value _n) {
+  encoder_t *enc = Enc_val(_enc);
+  if (enc->encoder == NULL)
+    return Val_int(OPUS_INVALID_STATE);
+  relaxed_store(&enc->timing.complexity, Int_val(_n));
+  return Val_int(OPUS_OK);
+}
 
-    /* Encoder controls. */
-    set_ctl(tag, Set_complexity, enc, opus_encoder_ctl, OPUS_SET_COMPLEXITY, v);
-    get_ctl(tag, Get_complexity, enc, opus_encoder_ctl, OPUS_GET_COMPLEXITY, v,
-            opus_int32);
-    set_ctl(tag, Set_vbr, enc, opus_encoder_ctl, OPUS_SET_VBR, v);
-    get_ctl(tag, Get_vbr, enc, opus_encoder_ctl, OPUS_GET_VBR, v, opus_int32);
-    set_ctl(tag, Set_vbr_constraint, enc, opus_encoder_ctl,
-            OPUS_SET_VBR_CONSTRAINT, v);
-    get_ctl(tag, Get_vbr_constraint, enc, opus_encoder_ctl,
-            OPUS_GET_VBR_CONSTRAINT, v, opus_int32);
-    set_ctl(tag, Set_force_channels, enc, opus_encoder_ctl,
-            OPUS_SET_FORCE_CHANNELS, v);
-    get_ctl(tag, Get_force_channels, enc, opus_encoder_ctl,
-            OPUS_GET_FORCE_CHANNELS, v, opus_int32);
-    get_ctl(tag, Get_samplerate, enc, opus_encoder_ctl, OPUS_GET_SAMPLE_RATE, v,
-            opus_int32);
-    get_ctl(tag, Get_lookhead, enc, opus_encoder_ctl, OPUS_GET_LOOKAHEAD, v,
-            opus_int32);
-    set_ctl(tag, Set_inband_fec, enc, opus_encoder_ctl, OPUS_SET_INBAND_FEC, v);
-    get_ctl(tag, Get_inband_fec, enc, opus_encoder_ctl, OPUS_GET_INBAND_FEC, v,
-            opus_int32);
-    set_ctl(tag, Set_packet_loss_perc, enc, opus_encoder_ctl,
-            OPUS_SET_PACKET_LOSS_PERC, v);
-    get_ctl(tag, Get_packet_loss_perc, enc, opus_encoder_ctl,
-            OPUS_GET_PACKET_LOSS_PERC, v, opus_int32);
-    set_ctl(tag, Set_dtx, enc, opus_encoder_ctl, OPUS_SET_DTX, v);
-    get_ctl(tag, Get_dtx, enc, opus_encoder_ctl, OPUS_GET_DTX, v, opus_int32);
-
-    /* These guys have polynmorphic variant as argument.. */
-    set_value_ctl(tag, Set_bitrate, enc, opus_encoder_ctl, OPUS_SET_BITRATE, v,
-                  bitrate_of_value);
-    get_value_ctl(tag, Get_bitrate, enc, opus_encoder_ctl, OPUS_GET_BITRATE, v,
-                  opus_int32, value_of_bitrate);
-    set_value_ctl(tag, Set_max_bandwidth, enc, opus_encoder_ctl,
-                  OPUS_SET_MAX_BANDWIDTH, v, bandwidth_of_value);
-    get_value_ctl(tag, Get_max_bandwidth, enc, opus_encoder_ctl,
-                  OPUS_GET_MAX_BANDWIDTH, v, opus_int32, value_of_bandwidth);
-    set_value_ctl(tag, Set_bandwidth, enc, opus_encoder_ctl, OPUS_SET_BANDWIDTH,
-                  v, bandwidth_of_value);
-    set_value_ctl(tag, Set_signal, enc, opus_encoder_ctl, OPUS_SET_SIGNAL, v,
-                  signal_of_value);
-    get_value_ctl(tag, Get_signal, enc, opus_encoder_ctl, OPUS_GET_SIGNAL, v,
-                  opus_int32, value_of_signal);
-    set_value_ctl(tag, Set_application, enc, opus_encoder_ctl,
-                  OPUS_SET_APPLICATION, v, application_of_value);
-    get_value_ctl(tag, Get_application, enc, opus_encoder_ctl,
-                  OPUS_GET_APPLICATION, v, opus_int32, value_of_application);
-  }
+static void encoder_apply_complexity(encoder_t *enc) {
+  int n = timing_complexity(&enc->timing);
+  if (n >= 0)
+    opus_encoder_ctl(enc->encoder, OPUS_SET_COMPLEXITY(n));
+}
 
-  caml_failwith("Unknown opus error");
+static int encoder_fade_len(encoder_t *enc) {
+  return FADE_MAX / enc->samplerate_ratio;
 }
 
-CAMLprim value ocaml_opus_encode_float(value _frame_size, value _enc, value _os,
-                                       value buf, value _off, value _len) {
-  CAMLparam3(_enc, buf, _os);
-  encoder_t *handler = Enc_val(_enc);
-  OpusEncoder *enc = handler->encoder;
-  ogg_stream_state *os = Stream_state_val(_os);
-  ogg_packet op;
-  int off = Int_val(_off);
+/* Raised cosine rising from 0 to 1 over [n] samples. */
+static float fade_gain(int i, int n) {
+  return 0.5 - 0.5 * cos(M_PI * (i + 1) / (n + 1));
+}
+
+static void fade_pcm(float *pcm, int chans, int ofs, int len, int n, int out) {
+  int i, c;
+  float g;
+
+  for (i = 0; i < len; i++) {
+    g = fade_gain(out ? n - 1 - (ofs + i) : ofs + i, n);
+    for (c = 0; c < chans; c++)
+      pcm[i * chans + c] *= g;
+  }
+}
+
+/* Fade in live input after a splice and keep its last samples, which are
+ * faded out when draining the encoder before the next one. */
+static void encoder_live_frame(encoder_t *enc, float *pcm, int chans,
+                               int frame_size) {
+  int n = encoder_fade_len(enc);
+  int len;
+
+  if (chans != enc->channels)
+    return;
+
+  if (enc->fade_in > 0) {
+    len = enc->fade_in < frame_size ? enc->fade_in : frame_size;
+    fade_pcm(pcm, chans, n - enc->fade_in, len, n, 0);
+    enc->fade_in -= len;
+  }
+
+  if (frame_size >= n)
+    memcpy(enc->tail, pcm + (frame_size - n) * chans,
+           n * chans * sizeof(float));
+  else {
+    memmove(enc->tail, enc->tail + frame_size * chans,
+            (n - frame_size) * chans * sizeof(float));
+    memcpy(enc->tail + (n - frame_size) * chans, pcm,
+           frame_size * chans * sizeof(float));
+  }
+}
+
+/* (Re)start measuring the loudness of encoded samples. */
+CAMLprim value ocaml_opus_encoder_enable_loudness(value _enc) {
+  CAMLparam1(_enc);
+  encoder_t *enc = Enc_val(_enc);
+
+  if (enc->encoder == NULL)
+    check(OPUS_INVALID_STATE);
+
+  free(enc->meter);
+  enc->meter = meter_create(48000 / enc->samplerate_ratio, enc->channels);
+  if (enc->meter == NULL)
+    caml_raise_out_of_memory();
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_opus_encoder_loudness(value _enc) {
+  CAMLparam1(_enc);
+  encoder_t *enc = Enc_val(_enc);
+
+  if (enc->meter == NULL)
+    caml_invalid_argument("Loudness measurement is not enabled.");
+
+  CAMLreturn(meter_result(enc->meter));
+}
+
+/* Per-frame activity flags, see Encoder.activity. The coding mode decided
+ * by the encoder is read from the packet's TOC and stored in bits 2-3: 0 for
+ * SILK, 1 for hybrid and 2 for CELT. */
+#define ACTIVITY_EMITTED 1
+#define ACTIVITY_IN_DTX 2
+
+static unsigned char *activity_data(value _activity, int frames) {
+  value activity;
+
+  if (!Is_block(_activity))
+    return NULL;
+
+  activity = Field(_activity, 0);
+  if (Caml_ba_array_val(activity)->dim[0] < frames)
+    caml_invalid_argument("Activity buffer too small.");
+
+  return Caml_ba_data_val(activity);
+}
+
+static unsigned char frame_activity(OpusEncoder *enc, const unsigned char *data,
+                                    int ret, int emitted) {
+  opus_int32 in_dtx = ret < 2;
+  int config = data[0] >> 3;
+  unsigned char flags = emitted ? ACTIVITY_EMITTED : 0;
+
+#ifdef OPUS_GET_IN_DTX
+  opus_encoder_ctl(enc, OPUS_GET_IN_DTX(&in_dtx));
+#endif
+  if (in_dtx)
+    flags |= ACTIVITY_IN_DTX;
+
+  return flags | (config < 12 ? 0 : config < 16 ? 1 : 2) << 2;
+}
+
+/* When [_eos] is non-negative, the last encoded frame ends the stream and
+ * only the first [_eos] samples of the input are counted in its granule
+ * position, the rest being padding. */
+CAMLprim value ocaml_opus_encode_float(value _frame_size, value _enc, value _os,
+                                       value buf, value _off, value _len,
+                                       value _eos, value _activity) {
+  CAMLparam4(_enc, buf, _os, _activity);
+  encoder_t *handler = Enc_val(_enc);
+  OpusEncoder *enc = handler->encoder;
+  ogg_stream_state *os = Stream_state_val(_os);
+  ogg_packet op;
+  int off = Int_val(_off);
   int len = Int_val(_len);
   int frame_size = Int_val(_frame_size);
+  int eos = Int_val(_eos);
+  ogg_int64_t eos_granulepos =
+      handler->pre_skip + handler->samples +
+      (ogg_int64_t)eos * handler->samplerate_ratio;
+
+  if (enc == NULL)
+    check(OPUS_INVALID_STATE);
 
   if (len < frame_size)
-    caml_raise_constant(*caml_named_value("opus_exn_buffer_too_small"));
+    caml_raise_constant(*opus_exn_buffer_too_small);
+
+  int loops = len / frame_size;
+  unsigned char *activity = activity_data(_activity, loops);
 
   int chans = Wosize_val(buf);
   /* This is the recommended value */
@@ -771,17 +1599,19 @@ CAMLprim value ocaml_opus_encode_float(value _frame_size, value _enc, value _os,
   float *pcm = malloc(chans * frame_size * sizeof(float));
   if (pcm == NULL)
     caml_raise_out_of_memory();
-  int i, j, c;
-  int ret;
-  int loops = len / frame_size;
+  int i;
+  int ret, last;
+  ogg_int64_t start;
   for (i = 0; i < loops; i++) {
-    for (j = 0; j < frame_size; j++)
-      for (c = 0; c < chans; c++)
-        pcm[chans * j + c] =
-            clip(Double_field(Field(buf, c), off + j + i * frame_size));
+    load_pcm(pcm, buf, off + i * frame_size, frame_size, handler->meter,
+             eos >= 0 ? eos - i * frame_size : frame_size);
+    encoder_live_frame(handler, pcm, chans, frame_size);
 
     caml_release_runtime_system();
+    encoder_apply_complexity(handler);
+    start = timing_start(&handler->timing);
     ret = opus_encode_float(enc, pcm, frame_size, data, max_data_bytes);
+    timing_stop(&handler->timing, start);
     caml_acquire_runtime_system();
 
     if (ret < 0) {
@@ -790,41 +1620,56 @@ CAMLprim value ocaml_opus_encode_float(value _frame_size, value _enc, value _os,
       check(ret);
     }
 
+    handler->buffered = 1;
+    last = eos >= 0 && i == loops - 1;
+
+    if (activity != NULL)
+      activity[i] = frame_activity(enc, data, ret, ret >= 2 || last);
+
+    /* Suppressed frames still account for their duration. */
+    handler->granulepos += frame_size * handler->samplerate_ratio;
+
     /* From the documentation: If the return value is 1 byte,
-     * then the packet does not need to be transmitted (DTX). */
-    if (ret < 2)
+     * then the packet does not need to be transmitted (DTX).
+     * The last packet is always sent since it ends the stream. */
+    if (ret < 2 && !last)
       continue;
 
-    handler->granulepos += frame_size * handler->samplerate_ratio;
     handler->packetno++;
 
     op.bytes = ret;
     op.packet = data;
-    op.b_o_s = op.e_o_s = 0;
+    op.b_o_s = 0;
+    op.e_o_s = last;
     op.packetno = handler->packetno;
-    op.granulepos = handler->granulepos;
+    op.granulepos = last ? eos_granulepos : handler->granulepos;
 
     if (ogg_stream_packetin(os, &op) != 0) {
       free(pcm);
       free(data);
-      caml_raise_constant(*caml_named_value("ogg_exn_internal_error"));
+      caml_raise_constant(*ogg_exn_internal_error);
     }
   }
   free(pcm);
   free(data);
 
+  handler->samples +=
+      (ogg_int64_t)(eos >= 0 ? eos : loops * frame_size) *
+      handler->samplerate_ratio;
+
   CAMLreturn(Val_int(loops * frame_size));
 }
 
 CAMLprim value ocaml_opus_encode_float_byte(value *argv, int argn) {
   return ocaml_opus_encode_float(argv[0], argv[1], argv[2], argv[3], argv[4],
-                                 argv[5]);
+                                 argv[5], argv[6], argv[7]);
 }
 
 CAMLprim value ocaml_opus_encode_float_ba(value _frame_size, value _enc,
                                           value _os, value buf, value _ofs,
-                                          value _len) {
-  CAMLparam3(_enc, buf, _os);
+                                          value _len, value _eos,
+                                          value _activity) {
+  CAMLparam4(_enc, buf, _os, _activity);
   encoder_t *handler = Enc_val(_enc);
   OpusEncoder *enc = handler->encoder;
   ogg_stream_state *os = Stream_state_val(_os);
@@ -833,6 +1678,13 @@ CAMLprim value ocaml_opus_encode_float_ba(value _frame_size, value _enc,
   int ofs = Int_val(_ofs);
   int chans = Wosize_val(buf);
   int frame_size = Int_val(_frame_size);
+  int eos = Int_val(_eos);
+  ogg_int64_t eos_granulepos =
+      handler->pre_skip + handler->samples +
+      (ogg_int64_t)eos * handler->samplerate_ratio;
+
+  if (enc == NULL)
+    check(OPUS_INVALID_STATE);
 
   if (chans == 0)
     CAMLreturn(Val_int(0));
@@ -841,7 +1693,10 @@ CAMLprim value ocaml_opus_encode_float_ba(value _frame_size, value _enc,
     caml_failwith("Invalid length or offset!");
 
   if (len < frame_size)
-    caml_raise_constant(*caml_named_value("opus_exn_buffer_too_small"));
+    caml_raise_constant(*opus_exn_buffer_too_small);
+
+  int loops = len / frame_size;
+  unsigned char *activity = activity_data(_activity, loops);
 
   /* This is the recommended value */
   int max_data_bytes = 4000;
@@ -851,17 +1706,19 @@ CAMLprim value ocaml_opus_encode_float_ba(value _frame_size, value _enc,
   float *pcm = malloc(chans * frame_size * sizeof(float));
   if (pcm == NULL)
     caml_raise_out_of_memory();
-  int i, j, c;
-  int ret;
-  int loops = len / frame_size;
+  int i;
+  int ret, last;
+  ogg_int64_t start;
   for (i = 0; i < loops; i++) {
-    for (j = 0; j < frame_size; j++)
-      for (c = 0; c < chans; c++)
-        pcm[chans * j + c] = ((float *)Caml_ba_data_val(
-            Field(buf, c)))[j + i * frame_size + ofs];
+    load_pcm_ba(pcm, buf, ofs + i * frame_size, frame_size, handler->meter,
+                eos >= 0 ? eos - i * frame_size : frame_size);
+    encoder_live_frame(handler, pcm, chans, frame_size);
 
     caml_release_runtime_system();
+    encoder_apply_complexity(handler);
+    start = timing_start(&handler->timing);
     ret = opus_encode_float(enc, pcm, frame_size, data, max_data_bytes);
+    timing_stop(&handler->timing, start);
     caml_acquire_runtime_system();
 
     if (ret < 0) {
@@ -870,35 +1727,53 @@ CAMLprim value ocaml_opus_encode_float_ba(value _frame_size, value _enc,
       check(ret);
     }
 
+    handler->buffered = 1;
+    last = eos >= 0 && i == loops - 1;
+
+    if (activity != NULL)
+      activity[i] = frame_activity(enc, data, ret, ret >= 2 || last);
+
+    /* Suppressed frames still account for their duration. */
+    handler->granulepos += frame_size * handler->samplerate_ratio;
+
     /* From the documentation: If the return value is 1 byte,
-     * then the packet does not need to be transmitted (DTX). */
-    if (ret < 2)
+     * then the packet does not need to be transmitted (DTX).
+     * The last packet is always sent since it ends the stream. */
+    if (ret < 2 && !last)
       continue;
 
-    handler->granulepos += frame_size * handler->samplerate_ratio;
     handler->packetno++;
 
     op.bytes = ret;
     op.packet = data;
-    op.b_o_s = op.e_o_s = 0;
+    op.b_o_s = 0;
+    op.e_o_s = last;
     op.packetno = handler->packetno;
-    op.granulepos = handler->granulepos;
+    op.granulepos = last ? eos_granulepos : handler->granulepos;
 
     if (ogg_stream_packetin(os, &op) != 0) {
       free(pcm);
       free(data);
-      caml_raise_constant(*caml_named_value("ogg_exn_internal_error"));
+      caml_raise_constant(*ogg_exn_internal_error);
     }
   }
   free(pcm);
   free(data);
 
+  handler->samples +=
+      (ogg_int64_t)(eos >= 0 ? eos : loops * frame_size) *
+      handler->samplerate_ratio;
+
   CAMLreturn(Val_int(loops * frame_size));
 }
 
 CAMLprim value ocaml_opus_encode_float_ba_byte(value *argv, int argn) {
   return ocaml_opus_encode_float_ba(argv[0], argv[1], argv[2], argv[3], argv[4],
-                                    argv[5]);
+                                    argv[5], argv[6], argv[7]);
+}
+
+CAMLprim value ocaml_opus_encoder_pre_skip(value _enc) {
+  return Val_int(Enc_val(_enc)->pre_skip);
 }
 
 CAMLprim value ocaml_opus_encode_eos(value _os, value _enc) {
@@ -906,6 +1781,10 @@ CAMLprim value ocaml_opus_encode_eos(value _os, value _enc) {
   ogg_stream_state *os = Stream_state_val(_os);
   ogg_packet op;
   encoder_t *handler = Enc_val(_enc);
+
+  if (handler->encoder == NULL)
+    check(OPUS_INVALID_STATE);
+
   handler->packetno++;
 
   op.bytes = 0;
@@ -916,8 +1795,1039 @@ CAMLprim value ocaml_opus_encode_eos(value _os, value _enc) {
   op.granulepos = handler->granulepos;
 
   if (ogg_stream_packetin(os, &op) != 0)
-    caml_raise_constant(*caml_named_value("ogg_exn_internal_error"));
+    caml_raise_constant(*ogg_exn_internal_error);
   ;
 
   CAMLreturn(Val_unit);
 }
+
+/* Encoded segments. Segments are encoded from a reset encoder, with their
+ * input padded to cover the encoder's delay. Before splicing them, the
+ * delay of the live encoder is drained and it is reset afterward, so that
+ * state changes always happen on silence. Every edge between live input,
+ * segments and silence is faded to avoid clicks. */
+
+static opus_int32 encoder_lookahead(encoder_t *handler) {
+  opus_int32 lookahead = 0;
+  opus_encoder_ctl(handler->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+  return lookahead;
+}
+
+static void encoder_packetin(encoder_t *handler, ogg_stream_state *os,
+                             unsigned char *data, long bytes,
+                             opus_int32 samples) {
+  ogg_packet op;
+
+  /* Samples are expressed at 48kHz. */
+  handler->granulepos += samples;
+  handler->samples += samples;
+
+  /* DTX. */
+  if (bytes < 2)
+    return;
+
+  handler->packetno++;
+
+  op.bytes = bytes;
+  op.packet = data;
+  op.b_o_s = op.e_o_s = 0;
+  op.packetno = handler->packetno;
+  op.granulepos = handler->granulepos;
+
+  if (ogg_stream_packetin(os, &op) != 0)
+    caml_raise_constant(*ogg_exn_internal_error);
+}
+
+/* Flush samples held in the encoder's delay with the shortest frame covering
+ * it and the fade out. Input is faded out from a mirror image of its last
+ * samples, so that it does not step to silence. */
+CAMLprim value ocaml_opus_encoder_drain(value _enc, value _os) {
+  CAMLparam2(_enc, _os);
+  encoder_t *handler = Enc_val(_enc);
+  ogg_stream_state *os = Stream_state_val(_os);
+  unsigned char data[4000];
+  opus_int32 sr, lookahead;
+  int chans = handler->channels;
+  int n = encoder_fade_len(handler);
+  int frame_size, ret, i;
+  float *pcm;
+
+  if (handler->encoder == NULL)
+    check(OPUS_INVALID_STATE);
+
+  if (!handler->buffered)
+    CAMLreturn(Val_unit);
+
+  sr = 48000 / handler->samplerate_ratio;
+  lookahead = encoder_lookahead(handler);
+  for (frame_size = sr / 400;
+       frame_size < lookahead + n && frame_size < sr / 50; frame_size *= 2)
+    ;
+
+  pcm = calloc(frame_size * chans, sizeof(float));
+  if (pcm == NULL)
+    caml_raise_out_of_memory();
+
+  for (i = 0; i < n; i++)
+    memcpy(pcm + i * chans, handler->tail + (n - 1 - i) * chans,
+           chans * sizeof(float));
+  fade_pcm(pcm, chans, 0, n, n, 1);
+
+  caml_release_runtime_system();
+  ret = opus_encode_float(handler->encoder, pcm, frame_size, data,
+                          sizeof(data));
+  caml_acquire_runtime_system();
+
+  free(pcm);
+  check(ret);
+
+  handler->buffered = 0;
+  encoder_packetin(handler, os, data, ret,
+                   frame_size * handler->samplerate_ratio);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Encode a whole segment from a reset encoder and return its raw packets,
+ * without adding them to the stream. */
+CAMLprim value ocaml_opus_encoder_encode_segment(value _frame_size,
+                                                 value _enc, value buf,
+                                                 value _ofs, value _len) {
+  CAMLparam2(_enc, buf);
+  CAMLlocal2(ans, packet);
+  encoder_t *handler = Enc_val(_enc);
+  OpusEncoder *enc = handler->encoder;
+  int frame_size = Int_val(_frame_size);
+  int ofs = Int_val(_ofs);
+  int len = Int_val(_len);
+  int chans = Wosize_val(buf);
+  int max_data_bytes = 4000;
+  opus_int32 sr = 48000 / handler->samplerate_ratio;
+  int n = encoder_fade_len(handler);
+  int frames, full, rem, size, pos, i, c, ret = 0;
+  int *sizes, *lens;
+  unsigned char *data;
+  float *pcm;
+  ogg_int64_t start;
+
+  if (enc == NULL)
+    check(OPUS_INVALID_STATE);
+
+  if (chans != handler->channels)
+    caml_invalid_argument("Wrong number of channels.");
+
+  for (c = 0; c < chans; c++)
+    if (Caml_ba_array_val(Field(buf, c))->dim[0] < ofs + len)
+      caml_failwith("Invalid length or offset!");
+
+  /* Whole frames, then the remainder with shorter frames so that padding
+   * is less than 2.5ms. */
+  rem = len + encoder_lookahead(handler);
+  full = rem / frame_size;
+  rem -= full * frame_size;
+  frames = full + 8;
+
+  pcm = calloc((size_t)(full + 2) * frame_size * chans, sizeof(float));
+  data = malloc((size_t)frames * max_data_bytes);
+  sizes = malloc(frames * sizeof(int));
+  lens = malloc(frames * sizeof(int));
+  if (pcm == NULL || data == NULL || sizes == NULL || lens == NULL) {
+    free(pcm);
+    free(data);
+    free(sizes);
+    free(lens);
+    caml_raise_out_of_memory();
+  }
+
+  for (frames = 0; frames < full; frames++)
+    lens[frames] = frame_size;
+  for (size = sr / 50; size >= sr / 400; size /= 2)
+    while (size < frame_size &&
+           (rem >= size || (size == sr / 400 && rem > 0))) {
+      lens[frames++] = size;
+      rem -= size;
+    }
+
+  load_pcm_ba(pcm, buf, ofs, len, NULL, 0);
+  if (len >= 2 * n) {
+    fade_pcm(pcm, chans, 0, n, n, 0);
+    fade_pcm(pcm + (len - n) * chans, chans, 0, n, n, 1);
+  }
+
+  caml_release_runtime_system();
+  opus_encoder_ctl(enc, OPUS_RESET_STATE);
+  encoder_apply_complexity(handler);
+  for (i = 0, pos = 0; i < frames; pos += lens[i++]) {
+    start = timing_start(&handler->timing);
+    ret = opus_encode_float(enc, pcm + pos * chans, lens[i],
+                            data + i * max_data_bytes, max_data_bytes);
+    timing_stop(&handler->timing, start);
+    if (ret < 0)
+      break;
+    sizes[i] = ret;
+  }
+  caml_acquire_runtime_system();
+
+  free(pcm);
+  free(lens);
+  if (ret < 0) {
+    free(data);
+    free(sizes);
+    check(ret);
+  }
+
+  ans = caml_alloc_tuple(frames);
+  for (i = 0; i < frames; i++) {
+    packet = caml_alloc_string(sizes[i]);
+    memcpy(Bytes_val(packet), data + i * max_data_bytes, sizes[i]);
+    Store_field(ans, i, packet);
+  }
+
+  free(data);
+  free(sizes);
+
+  CAMLreturn(ans);
+}
+
+/* FNV-1a hash of a segment's samples, used as a cache key. */
+CAMLprim value ocaml_opus_segment_hash(value buf, value _ofs, value _len) {
+  CAMLparam1(buf);
+  int ofs = Int_val(_ofs);
+  int len = Int_val(_len);
+  ogg_uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *data;
+  size_t i;
+  int c;
+
+  for (c = 0; c < Wosize_val(buf); c++) {
+    if (Caml_ba_array_val(Field(buf, c))->dim[0] < ofs + len)
+      caml_failwith("Invalid length or offset!");
+
+    data = (const unsigned char *)((float *)Caml_ba_data_val(Field(buf, c)) +
+                                   ofs);
+    for (i = 0; i < len * sizeof(float); i++)
+      hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+
+  CAMLreturn(caml_copy_int64(hash));
+}
+
+/* Add raw packets to the stream and reset the encoder. */
+CAMLprim value ocaml_opus_encoder_splice(value _enc, value _os,
+                                         value packets) {
+  CAMLparam3(_enc, _os, packets);
+  encoder_t *handler = Enc_val(_enc);
+  ogg_stream_state *os = Stream_state_val(_os);
+  unsigned char *data;
+  long bytes;
+  int i, samples;
+
+  if (handler->encoder == NULL)
+    check(OPUS_INVALID_STATE);
+
+  for (i = 0; i < Wosize_val(packets); i++) {
+    data = (unsigned char *)Bytes_val(Field(packets, i));
+    bytes = caml_string_length(Field(packets, i));
+    samples = opus_packet_get_nb_samples(data, bytes, 48000);
+    check(samples);
+    encoder_packetin(handler, os, data, bytes, samples);
+  }
+
+  opus_encoder_ctl(handler->encoder, OPUS_RESET_STATE);
+  handler->buffered = 0;
+  handler->fade_in = encoder_fade_len(handler);
+
+  CAMLreturn(Val_unit);
+}
+
+/***** Vectored calls *****/
+
+/* Encode or decode one frame for each of many handles in a single call, with
+ * raw packets and interleaved samples taken from slices of shared bigarrays.
+ * Slices are checked beforehand and errors are reported per handle. Jobs can
+ * be spread over several threads: a given handle must then appear only once
+ * and its repetitions are rejected. Threads are started for each call, which
+ * costs tens of microseconds: this only pays off for very large batches. */
+#define MANY_MAX_THREADS 64
+
+/* Threaded calls are numbered to detect repeated handles. */
+static unsigned long many_calls = 0;
+
+static unsigned long many_call(int threads) {
+  return threads > 1 ? relaxed_add(&many_calls, 1) + 1 : 0;
+}
+
+/* Whether a handle already has a job in the threaded call [call]. */
+static int many_repeated(unsigned long *handle_call, unsigned long call) {
+  if (call == 0)
+    return 0;
+  if (*handle_call == call)
+    return 1;
+  *handle_call = call;
+  return 0;
+}
+
+typedef struct many_worker_t {
+  void (*run)(void *job);
+  char *jobs;
+  size_t job_size;
+  int count;
+  int first;
+  int stride;
+} many_worker_t;
+
+static void *many_worker(void *arg) {
+  many_worker_t *w = arg;
+  int i;
+
+  for (i = w->first; i < w->count; i += w->stride)
+    w->run(w->jobs + i * w->job_size);
+
+  return NULL;
+}
+
+/* Must be called without the OCaml runtime. */
+static void run_many(void (*run)(void *), void *jobs, size_t job_size,
+                     int count, int threads) {
+  many_worker_t workers[MANY_MAX_THREADS];
+  int k;
+#ifndef _WIN32
+  pthread_t tids[MANY_MAX_THREADS];
+  int started[MANY_MAX_THREADS];
+#endif
+
+  if (threads > MANY_MAX_THREADS)
+    threads = MANY_MAX_THREADS;
+  if (threads > count)
+    threads = count;
+#ifdef _WIN32
+  threads = 1;
+#endif
+  if (threads < 1)
+    threads = 1;
+
+  for (k = 0; k < threads; k++) {
+    workers[k].run = run;
+    workers[k].jobs = jobs;
+    workers[k].job_size = job_size;
+    workers[k].count = count;
+    workers[k].first = k;
+    workers[k].stride = threads;
+  }
+
+#ifndef _WIN32
+  for (k = 1; k < threads; k++)
+    started[k] = !pthread_create(&tids[k], NULL, many_worker, &workers[k]);
+#endif
+
+  many_worker(&workers[0]);
+
+#ifndef _WIN32
+  for (k = 1; k < threads; k++) {
+    /* Run the share of workers which could not be started here. */
+    if (started[k])
+      pthread_join(tids[k], NULL);
+    else
+      many_worker(&workers[k]);
+  }
+#endif
+}
+
+/* Slice [ofs, ofs + len) of an array of [dim] elements. */
+static int many_slice_ok(intnat ofs, intnat len, intnat dim) {
+  return ofs >= 0 && len >= 0 && ofs <= dim && len <= dim - ofs;
+}
+
+typedef struct encode_job_t {
+  encoder_t *handler;
+  const float *pcm;
+  int frame_size;
+  unsigned char *data;
+  int max_bytes;
+  int ret;
+} encode_job_t;
+
+static void encode_job(void *arg) {
+  encode_job_t *job = arg;
+  encoder_t *handler = job->handler;
+  meter_t *m = handler->meter;
+  ogg_int64_t start;
+  int i, c;
+
+  if (job->ret < 0)
+    return;
+
+  if (m != NULL)
+    for (i = 0; i < job->frame_size; i++) {
+      for (c = 0; c < handler->channels; c++)
+        meter_add(m, c, job->pcm[i * handler->channels + c]);
+      meter_next(m);
+    }
+
+  encoder_apply_complexity(handler);
+  start = timing_start(&handler->timing);
+  job->ret = opus_encode_float(handler->encoder, job->pcm, job->frame_size,
+                               job->data, job->max_bytes);
+  timing_stop(&handler->timing, start);
+}
+
+CAMLprim value ocaml_opus_encoder_encode_many(value _encs, value _frame_size,
+                                              value _threads, value _pcm,
+                                              value _pcm_ofs, value _data,
+                                              value _data_ofs,
+                                              value _data_len) {
+  CAMLparam5(_encs, _pcm, _pcm_ofs, _data, _data_ofs);
+  CAMLxparam1(_data_len);
+  CAMLlocal1(ans);
+  int count = Wosize_val(_encs);
+  intnat pcm_dim = Caml_ba_array_val(_pcm)->dim[0];
+  intnat data_dim = Caml_ba_array_val(_data)->dim[0];
+  float *pcm = Caml_ba_data_val(_pcm);
+  unsigned char *data = Caml_ba_data_val(_data);
+  encode_job_t *jobs;
+  encode_job_t *job;
+  unsigned long call = many_call(Int_val(_threads));
+  intnat ofs, len;
+  int i;
+
+  if (Wosize_val(_pcm_ofs) != count || Wosize_val(_data_ofs) != count ||
+      Wosize_val(_data_len) != count)
+    caml_invalid_argument("Encoder.encode_many: array lengths mismatch.");
+
+  jobs = malloc(count * sizeof(encode_job_t) + 1);
+  if (jobs == NULL)
+    caml_raise_out_of_memory();
+
+  for (i = 0; i < count; i++) {
+    job = &jobs[i];
+    job->handler = Enc_val(Field(_encs, i));
+    job->frame_size = Int_val(_frame_size) / job->handler->samplerate_ratio;
+    job->ret = 0;
+
+    ofs = Long_val(Field(_pcm_ofs, i));
+    len = (intnat)job->frame_size * job->handler->channels;
+    if (!many_slice_ok(ofs, len, pcm_dim)) {
+      job->ret = OPUS_BAD_ARG;
+      continue;
+    }
+    job->pcm = pcm + ofs;
+
+    ofs = Long_val(Field(_data_ofs, i));
+    len = Long_val(Field(_data_len, i));
+    if (!many_slice_ok(ofs, len, data_dim)) {
+      job->ret = OPUS_BAD_ARG;
+      continue;
+    }
+    job->data = data + ofs;
+    job->max_bytes = len;
+
+    if (job->handler->encoder == NULL)
+      job->ret = OPUS_INVALID_STATE;
+    else if (many_repeated(&job->handler->many_call, call))
+      job->ret = OPUS_BAD_ARG;
+  }
+
+  caml_release_runtime_system();
+  run_many(encode_job, jobs, sizeof(encode_job_t), count,
+           Int_val(_threads));
+  caml_acquire_runtime_system();
+
+  ans = caml_alloc(count, 0);
+  for (i = 0; i < count; i++)
+    Store_field(ans, i, Val_int(jobs[i].ret));
+  free(jobs);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_opus_encoder_encode_many_byte(value *argv, int argn) {
+  return ocaml_opus_encoder_encode_many(argv[0], argv[1], argv[2], argv[3],
+                                        argv[4], argv[5], argv[6], argv[7]);
+}
+
+/* Samples are written with the decoder's own channels, without mixing. */
+typedef struct decode_job_t {
+  decoder_t *handler;
+  const unsigned char *data;
+  int bytes;
+  float *pcm;
+  int len;
+  int decode_fec;
+  int ret;
+} decode_job_t;
+
+static void decode_job(void *arg) {
+  decode_job_t *job = arg;
+  decoder_t *handler = job->handler;
+  meter_t *m = handler->meter;
+  int chans = handler->channels;
+  ogg_int64_t start;
+  int i, c, skip, ret;
+
+  if (job->ret < 0)
+    return;
+
+  /* Empty packets are decoded as lost. */
+  decoder_apply_complexity(handler);
+  start = timing_start(&handler->timing);
+  ret = opus_decode_float(handler->decoder, job->bytes > 0 ? job->data : NULL,
+                          job->bytes, job->pcm, job->len, job->decode_fec);
+  timing_stop(&handler->timing, start);
+
+  if (ret < 0) {
+    job->ret = ret;
+    return;
+  }
+
+  /* Discard pre-skip samples. */
+  skip = handler->pre_skip < ret ? handler->pre_skip : ret;
+  handler->pre_skip -= skip;
+  ret -= skip;
+  if (skip > 0)
+    memmove(job->pcm, job->pcm + skip * chans, ret * chans * sizeof(float));
+
+  if (m != NULL)
+    for (i = 0; i < ret; i++) {
+      for (c = 0; c < chans; c++)
+        meter_add(m, c, job->pcm[i * chans + c]);
+      meter_next(m);
+    }
+
+  job->ret = ret;
+}
+
+CAMLprim value ocaml_opus_decoder_decode_many(value _decs, value _fec,
+                                              value _threads, value _data,
+                                              value _data_ofs, value _data_len,
+                                              value _pcm, value _pcm_ofs,
+                                              value _pcm_len) {
+  CAMLparam5(_decs, _data, _data_ofs, _data_len, _pcm);
+  CAMLxparam2(_pcm_ofs, _pcm_len);
+  CAMLlocal1(ans);
+  int count = Wosize_val(_decs);
+  intnat data_dim = Caml_ba_array_val(_data)->dim[0];
+  intnat pcm_dim = Caml_ba_array_val(_pcm)->dim[0];
+  unsigned char *data = Caml_ba_data_val(_data);
+  float *pcm = Caml_ba_data_val(_pcm);
+  decode_job_t *jobs;
+  decode_job_t *job;
+  unsigned long call = many_call(Int_val(_threads));
+  intnat ofs, len;
+  int i;
+
+  if (Wosize_val(_data_ofs) != count || Wosize_val(_data_len) != count ||
+      Wosize_val(_pcm_ofs) != count || Wosize_val(_pcm_len) != count)
+    caml_invalid_argument("Decoder.decode_many: array lengths mismatch.");
+
+  jobs = malloc(count * sizeof(decode_job_t) + 1);
+  if (jobs == NULL)
+    caml_raise_out_of_memory();
+
+  for (i = 0; i < count; i++) {
+    job = &jobs[i];
+    job->handler = Dec_val(Field(_decs, i));
+    job->decode_fec = Bool_val(_fec);
+    job->ret = 0;
+
+    ofs = Long_val(Field(_data_ofs, i));
+    len = Long_val(Field(_data_len, i));
+    if (!many_slice_ok(ofs, len, data_dim)) {
+      job->ret = OPUS_BAD_ARG;
+      continue;
+    }
+    job->data = data + ofs;
+    job->bytes = len;
+
+    ofs = Long_val(Field(_pcm_ofs, i));
+    len = Long_val(Field(_pcm_len, i));
+    if (!many_slice_ok(ofs, len * job->handler->channels, pcm_dim)) {
+      job->ret = OPUS_BAD_ARG;
+      continue;
+    }
+    job->pcm = pcm + ofs;
+    job->len = len;
+
+    if (job->handler->decoder == NULL)
+      job->ret = OPUS_INVALID_STATE;
+    else if (many_repeated(&job->handler->many_call, call))
+      job->ret = OPUS_BAD_ARG;
+  }
+
+  caml_release_runtime_system();
+  run_many(decode_job, jobs, sizeof(decode_job_t), count,
+           Int_val(_threads));
+  caml_acquire_runtime_system();
+
+  ans = caml_alloc(count, 0);
+  for (i = 0; i < count; i++)
+    Store_field(ans, i, Val_int(jobs[i].ret));
+  free(jobs);
+
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_opus_decoder_decode_many_byte(value *argv, int argn) {
+  return ocaml_opus_decoder_decode_many(argv[0], argv[1], argv[2], argv[3],
+                                        argv[4], argv[5], argv[6], argv[7],
+                                        argv[8]);
+}
+
+/***** File *****/
+
+/* Ogg pages are read in place from a memory-mapped file: packets are only
+ * copied when they span several pages. */
+
+static ogg_uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+  ogg_uint32_t r;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    r = (ogg_uint32_t)i << 24;
+    for (j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : r << 1;
+    crc_table[i] = r;
+  }
+}
+
+/* CRC of a page, computed with a zeroed checksum field. */
+static ogg_uint32_t page_crc(const unsigned char *page, size_t len) {
+  ogg_uint32_t crc = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    crc = (crc << 8) ^
+          crc_table[((crc >> 24) & 0xff) ^ (i >= 22 && i < 26 ? 0 : page[i])];
+
+  return crc;
+}
+
+static ogg_uint32_t read_uint32le(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((ogg_uint32_t)p[3] << 24);
+}
+
+typedef struct file_t {
+  /* Mapped bigarray, registered as a global root. */
+  value data;
+  const unsigned char *base;
+  size_t len;
+  /* Offset of the next page. */
+  size_t pos;
+
+  /* Current page. */
+  const unsigned char *lacing;
+  const unsigned char *body;
+  int segments;
+  int segment;
+
+  /* Followed logical stream. */
+  int in_stream;
+  ogg_uint32_t serial;
+  int stream_ended;
+  /* Pages without BOS flag were read since the link started: all the BOS
+   * pages of a link come first, later ones start a new link. */
+  int in_link;
+  int first_packet;
+  /* Expected sequence number of its next page. */
+  ogg_uint32_t sequence;
+
+  /* Current packet. */
+  const unsigned char *packet;
+  long bytes;
+  int bos;
+  /* Current packet has been put back and is returned again by the next call
+   * to file_next_packet. */
+  int pending;
+
+  /* Beginning of a packet spanning several pages. */
+  unsigned char *partial;
+  size_t partial_len;
+  size_t partial_size;
+  int continued;
+} file_t;
+
+#define File_val(v) (*(file_t **)Data_custom_val(v))
+
+static void release_file(file_t *r) {
+  if (r->base == NULL)
+    return;
+
+  caml_remove_generational_global_root(&r->data);
+  r->base = NULL;
+  r->len = r->pos = 0;
+  r->lacing = NULL;
+  r->pending = 0;
+}
+
+static void finalize_file(value v) {
+  file_t *r = File_val(v);
+  release_file(r);
+  free(r->partial);
+  free(r);
+}
+
+static struct custom_operations file_ops = {
+    "ocaml_opus_file",        finalize_file,
+    custom_compare_default,   custom_hash_default,
+    custom_serialize_default, custom_deserialize_default};
+
+CAMLprim value ocaml_opus_file_create(value data, value _sequential) {
+  CAMLparam1(data);
+  CAMLlocal1(ans);
+  file_t *r = calloc(1, sizeof(file_t));
+  if (r == NULL)
+    caml_raise_out_of_memory();
+
+  r->data = data;
+  caml_register_generational_global_root(&r->data);
+  r->base = Caml_ba_data_val(data);
+  r->len = Caml_ba_array_val(data)->dim[0];
+
+#ifdef MADV_SEQUENTIAL
+  if (Bool_val(_sequential) && r->len > 0)
+    madvise((void *)r->base, r->len, MADV_SEQUENTIAL);
+#endif
+
+  ans = caml_alloc_custom(&file_ops, sizeof(file_t *), 0, 1);
+  File_val(ans) = r;
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_opus_file_close(value _r) {
+  CAMLparam1(_r);
+  release_file(File_val(_r));
+  CAMLreturn(Val_unit);
+}
+
+/* Load the next valid page of the followed stream. A new stream is followed
+ * when an Opus stream starts and there is no current stream or it has ended.
+ * Returns 0 at the end of the file. */
+static int file_next_page(file_t *r) {
+  const unsigned char *p;
+  size_t header_len, body_len;
+  ogg_uint32_t serial, sequence;
+  int i, flags, l, lost;
+
+  while (r->pos + 27 <= r->len) {
+    p = r->base + r->pos;
+
+    if (memcmp(p, "OggS", 4) || p[4] != 0) {
+      r->pos++;
+      continue;
+    }
+
+    header_len = 27 + p[26];
+    body_len = 0;
+    if (r->pos + header_len <= r->len)
+      for (i = 0; i < p[26]; i++)
+        body_len += p[27 + i];
+
+    if (r->pos + header_len + body_len > r->len ||
+        read_uint32le(p + 22) != page_crc(p, header_len + body_len)) {
+      r->pos++;
+      continue;
+    }
+
+    r->pos += header_len + body_len;
+    flags = p[5];
+    serial = read_uint32le(p + 14);
+    sequence = read_uint32le(p + 18);
+
+    /* Links truncated without an EOS page are also left. */
+    if ((flags & 0x02) && (!r->in_stream || r->stream_ended || r->in_link) &&
+        body_len >= 8 && !memcmp(p + header_len, "OpusHead", 8)) {
+      r->in_stream = 1;
+      r->serial = serial;
+      r->stream_ended = 0;
+      r->in_link = 0;
+      r->first_packet = 1;
+      r->continued = 0;
+      r->sequence = sequence;
+    }
+
+    if (!(flags & 0x02))
+      r->in_link = 1;
+
+    if (!r->in_stream || r->stream_ended || serial != r->serial)
+      continue;
+
+    if (flags & 0x04)
+      r->stream_ended = 1;
+
+    /* Pages are numbered consecutively: a gap means that pages were lost or
+     * failed their CRC. */
+    lost = sequence != r->sequence;
+    r->sequence = sequence + 1;
+
+    r->lacing = p + 27;
+    r->body = p + header_len;
+    r->segments = p[26];
+    r->segment = 0;
+
+    /* A page was lost: drop the partial packet and skip the rest of the
+     * continued one. */
+    if (lost || !(flags & 0x01))
+      r->continued = 0;
+
+    if ((flags & 0x01) && !r->continued)
+      while (r->segment < r->segments) {
+        l = r->lacing[r->segment++];
+        r->body += l;
+        if (l != 255)
+          break;
+      }
+
+    return 1;
+  }
+
+  return 0;
+}
+
+static int file_append_partial(file_t *r, const unsigned char *data,
+                               size_t len) {
+  unsigned char *partial;
+  size_t size;
+
+  if (!r->continued)
+    r->partial_len = 0;
+
+  if (r->partial_len + len > r->partial_size) {
+    size = 2 * (r->partial_len + len);
+    partial = realloc(r->partial, size);
+    if (partial == NULL)
+      return 0;
+    r->partial = partial;
+    r->partial_size = size;
+  }
+
+  memcpy(r->partial + r->partial_len, data, len);
+  r->partial_len += len;
+  return 1;
+}
+
+/* Returns 1 if a packet is available, 0 at the end of the file and
+ * OPUS_ALLOC_FAIL if memory is exhausted. Does not use the OCaml runtime. */
+static int file_next_packet(file_t *r) {
+  const unsigned char *start;
+  long bytes;
+  int l;
+
+  if (r->pending) {
+    r->pending = 0;
+    return 1;
+  }
+
+  while (1) {
+    if (r->lacing == NULL || r->segment >= r->segments) {
+      if (!file_next_page(r))
+        return 0;
+      continue;
+    }
+
+    start = r->body;
+    bytes = 0;
+    do {
+      l = r->lacing[r->segment++];
+      bytes += l;
+    } while (l == 255 && r->segment < r->segments);
+    r->body += bytes;
+
+    /* Packet continues on the next page. */
+    if (l == 255) {
+      if (!file_append_partial(r, start, bytes))
+        return OPUS_ALLOC_FAIL;
+      r->continued = 1;
+      continue;
+    }
+
+    if (r->continued) {
+      if (!file_append_partial(r, start, bytes))
+        return OPUS_ALLOC_FAIL;
+      r->continued = 0;
+      r->packet = r->partial;
+      r->bytes = r->partial_len;
+    } else {
+      r->packet = start;
+      r->bytes = bytes;
+    }
+
+    r->bos = r->first_packet;
+    r->first_packet = 0;
+    return 1;
+  }
+}
+
+CAMLprim value ocaml_opus_file_next_packet(value _r) {
+  CAMLparam1(_r);
+  int ret = file_next_packet(File_val(_r));
+  check(ret);
+  CAMLreturn(Val_bool(ret));
+}
+
+CAMLprim value ocaml_opus_file_packet_bos(value _r) {
+  return Val_bool(File_val(_r)->bos);
+}
+
+CAMLprim value ocaml_opus_file_packet(value _r) {
+  CAMLparam1(_r);
+  CAMLlocal1(ans);
+  file_t *r = File_val(_r);
+  ans = caml_alloc_string(r->bytes);
+  memcpy(Bytes_val(ans), r->packet, r->bytes);
+  CAMLreturn(ans);
+}
+
+CAMLprim value ocaml_opus_file_comments(value _r) {
+  CAMLparam1(_r);
+  file_t *r = File_val(_r);
+  CAMLreturn(parse_comments((unsigned char *)r->packet, r->bytes));
+}
+
+/* Decode packets of the followed stream into [pcm] until [len] samples are
+ * decoded, the stream ends or a new stream starts. Does not use the OCaml
+ * runtime. Returns the number of decoded samples or an error code. */
+static int file_decode(file_t *r, decoder_t *dec, float *pcm, int len,
+                       int decode_fec) {
+  int chans = dec->channels;
+  int total = 0;
+  int ret, skip;
+  ogg_int64_t start;
+
+  while (total < len) {
+    ret = file_next_packet(r);
+    if (ret < 0)
+      return ret;
+    if (ret == 0)
+      break;
+
+    /* Leave the new stream's headers to the caller. */
+    if (r->bos) {
+      r->pending = 1;
+      break;
+    }
+
+    decoder_apply_complexity(dec);
+    start = timing_start(&dec->timing);
+    ret = opus_decode_float(dec->decoder, r->packet, r->bytes,
+                            pcm + total * chans, len - total, decode_fec);
+    timing_stop(&dec->timing, start);
+
+    /* Keep the packet for the next call. */
+    if (ret == OPUS_BUFFER_TOO_SMALL) {
+      r->pending = 1;
+      if (total > 0)
+        break;
+    }
+
+    if (ret < 0)
+      return ret;
+
+    /* Discard pre-skip samples. */
+    skip = dec->pre_skip < ret ? dec->pre_skip : ret;
+    dec->pre_skip -= skip;
+    if (skip > 0)
+      memmove(pcm + total * chans, pcm + (total + skip) * chans,
+              (ret - skip) * chans * sizeof(float));
+
+    total += ret - skip;
+  }
+
+  return total;
+}
+
+CAMLprim value ocaml_opus_file_decode_float(value _r, value _dec, value buf,
+                                            value _ofs, value _len,
+                                            value _fec) {
+  CAMLparam3(_r, _dec, buf);
+  file_t *r = File_val(_r);
+  decoder_t *dec = Dec_val(_dec);
+  int ofs = Int_val(_ofs);
+  int len = Int_val(_len);
+  int decode_fec = Int_val(_fec);
+  int chans = dec->channels;
+  float mix_tmp[MIX_MAX_OUTPUTS * 2];
+  const float *mix;
+  int c, ret;
+
+  if (dec->decoder == NULL || r->base == NULL)
+    check(OPUS_INVALID_STATE);
+
+  mix = decoder_mix(dec, Wosize_val(buf), mix_tmp);
+
+  for (c = 0; c < Wosize_val(buf); c++)
+    if (ofs < 0 || len < 0 ||
+        Wosize_val(Field(buf, c)) / Double_wosize < ofs + len)
+      caml_failwith("Invalid length or offset!");
+
+  float *pcm = malloc(chans * len * sizeof(float));
+  if (pcm == NULL)
+    caml_raise_out_of_memory();
+
+  caml_release_runtime_system();
+  ret = file_decode(r, dec, pcm, len, decode_fec);
+  caml_acquire_runtime_system();
+
+  if (ret < 0) {
+    free(pcm);
+    check(ret);
+  }
+
+  store_pcm(buf, ofs, pcm, chans, ret, mix, dec->meter);
+
+  free(pcm);
+  CAMLreturn(Val_int(ret));
+}
+
+CAMLprim value ocaml_opus_file_decode_float_byte(value *argv, int argn) {
+  return ocaml_opus_file_decode_float(argv[0], argv[1], argv[2], argv[3],
+                                      argv[4], argv[5]);
+}
+
+CAMLprim value ocaml_opus_file_decode_float_ba(value _r, value _dec, value buf,
+                                               value _ofs, value _len,
+                                               value _fec) {
+  CAMLparam3(_r, _dec, buf);
+  file_t *r = File_val(_r);
+  decoder_t *dec = Dec_val(_dec);
+  int ofs = Int_val(_ofs);
+  int len = Int_val(_len);
+  int decode_fec = Int_val(_fec);
+  int chans = dec->channels;
+  float mix_tmp[MIX_MAX_OUTPUTS * 2];
+  const float *mix;
+  int c, ret;
+
+  if (dec->decoder == NULL || r->base == NULL)
+    check(OPUS_INVALID_STATE);
+
+  mix = decoder_mix(dec, Wosize_val(buf), mix_tmp);
+
+  for (c = 0; c < Wosize_val(buf); c++)
+    if (ofs < 0 || len < 0 ||
+        Caml_ba_array_val(Field(buf, c))->dim[0] < ofs + len)
+      caml_failwith("Invalid length or offset!");
+
+  float *pcm = malloc(chans * len * sizeof(float));
+  if (pcm == NULL)
+    caml_raise_out_of_memory();
+
+  caml_release_runtime_system();
+  ret = file_decode(r, dec, pcm, len, decode_fec);
+  caml_acquire_runtime_system();
+
+  if (ret < 0) {
+    free(pcm);
+    check(ret);
+  }
+
+  store_pcm_ba(buf, ofs, pcm, chans, ret, mix, dec->meter);
+
+  free(pcm);
+  CAMLreturn(Val_int(ret));
+}
+
+CAMLprim value ocaml_opus_file_decode_float_ba_byte(value *argv, int argn) {
+  return ocaml_opus_file_decode_float_ba(argv[0], argv[1], argv[2], argv[3],
+                                         argv[4], argv[5]);
+}
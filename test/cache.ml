@@ -0,0 +1,103 @@
+(* Cache hits, misses and eviction, and granule positions across splices. *)
+
+let frame_size = 960
+let len = 4800
+
+(* Voip encoders at 48kHz have a delay of 312 samples: it is drained with a
+   10ms frame, which also holds the fade out. The segment and its own delay
+   are covered by five 20ms frames, then 5ms and 2.5ms. *)
+let drained = 480
+let spliced = (5 * 960) + 240 + 120
+
+let segment =
+  let ba = Bigarray.Array1.create Bigarray.float32 Bigarray.c_layout len in
+  for i = 0 to len - 1 do
+    ba.{i} <- 0.5 *. sin (float i *. 0.05)
+  done;
+  [| ba |]
+
+let encoder () =
+  let os = Ogg.Stream.create () in
+  (os, Opus.Encoder.create ~samplerate:48000 ~channels:1 ~application:`Voip os)
+
+(* Write pending pages and return the granule position of the last one. *)
+let flush os oc =
+  let rec f granulepos =
+    match Ogg.Stream.flush_page os with
+      | (ph, pb) as page ->
+          output_string oc (ph ^ pb);
+          f (Ogg.Page.granulepos page)
+      | exception Ogg.Not_enough_data -> granulepos
+  in
+  f (-1L)
+
+let () =
+  let oc = open_out_bin "cache.ogg" in
+  let os, enc = encoder () in
+  Ogg.Stream.put_packet os (Opus.Encoder.header enc);
+  Ogg.Stream.put_packet os (Opus.Encoder.comments enc);
+  ignore (flush os oc);
+
+  let cache = Opus.Cache.create () in
+  let live n =
+    let pcm =
+      [| Array.init (n * frame_size) (fun i -> 0.5 *. sin (float i *. 0.1)) |]
+    in
+    let len = n * frame_size in
+    assert (Opus.Encoder.encode_float enc pcm 0 len = len);
+    flush os oc
+  in
+  let splice () =
+    Opus.Cache.splice ~key:"a" cache enc segment 0 len;
+    flush os oc
+  in
+  let granulepos = ref (live 5) in
+  let advance g n =
+    assert (Int64.sub g !granulepos = Int64.of_int n);
+    granulepos := g
+  in
+  advance (splice ()) (drained + spliced);
+  advance (live 2) (2 * frame_size);
+  advance (splice ()) (drained + spliced);
+  (* Nothing is left to drain right after a splice. *)
+  advance (splice ()) spliced;
+  advance (live 1) frame_size;
+
+  let stats = Opus.Cache.stats cache in
+  assert (stats.hits = 2 && stats.misses = 1 && stats.entries = 1);
+  let size = stats.bytes in
+  assert (size > 0);
+
+  Opus.Encoder.eos enc;
+  ignore (flush os oc);
+  close_out oc;
+
+  (* Packets decode back to back: the stream's length matches its last
+     granule position. *)
+  let f = Opus.File.openfile "cache.ogg" in
+  let buf = [| Array.make frame_size 0. |] in
+  let n = ref 0 in
+  (try
+     while true do
+       n := !n + Opus.File.decode_float f buf 0 frame_size
+     done
+   with Ogg.End_of_stream -> ());
+  Opus.File.close f;
+  assert (!n = Int64.to_int !granulepos - Opus.Encoder.pre_skip enc);
+
+  (* Room for two segments and a half: the least recently used one goes. *)
+  let _, enc = encoder () in
+  let cache = Opus.Cache.create ~max_bytes:((2 * size) + (size / 2)) () in
+  let splice key = Opus.Cache.splice ~key cache enc segment 0 len in
+  splice "a";
+  splice "b";
+  splice "a";
+  splice "c";
+  let stats = Opus.Cache.stats cache in
+  assert (stats.hits = 1 && stats.misses = 3);
+  assert (stats.evictions = 1 && stats.entries = 2 && stats.bytes = 2 * size);
+  splice "a";
+  assert ((Opus.Cache.stats cache).hits = 2);
+  splice "b";
+  let stats = Opus.Cache.stats cache in
+  assert (stats.misses = 4 && stats.evictions = 2)
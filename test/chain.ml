@@ -0,0 +1,34 @@
+(* A link truncated without an EOS page must not hide the next one. *)
+
+let read fname =
+  let ic = open_in_bin fname in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  s
+
+let samples fname =
+  let f = Opus.File.openfile fname in
+  let buf = Array.make 2 (Array.make 960 0.) in
+  let n = ref 0 in
+  (try
+     while true do
+       n := !n + Opus.File.decode_float f buf 0 960
+     done
+   with Ogg.End_of_stream -> ());
+  Opus.File.close f;
+  !n
+
+let () =
+  let first = read Sys.argv.(1) in
+  let oc = open_out_bin "truncated.ogg" in
+  output_string oc (String.sub first 0 (String.length first / 2));
+  output_string oc (read Sys.argv.(2));
+  close_out oc;
+  assert (samples "truncated.ogg" > samples Sys.argv.(2));
+
+  (* Out of bounds output. *)
+  let f = Opus.File.openfile Sys.argv.(1) in
+  (match Opus.File.decode_float f [| [||]; [||] |] 0 960 with
+    | _ -> assert false
+    | exception Failure _ -> ());
+  Opus.File.close f
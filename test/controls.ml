@@ -0,0 +1,45 @@
+(* Typed controls and apply_control. *)
+
+let () =
+  let enc =
+    Opus.Encoder.create ~samplerate:48000 ~channels:2 ~application:`Audio
+      (Ogg.Stream.create ())
+  in
+  let control c = Opus.Encoder.apply_control c enc in
+
+  Opus.Encoder.set_bitrate enc 64000;
+  assert (Opus.Encoder.get_bitrate enc = 64000);
+  let bitrate = ref `Auto in
+  control (`Get_bitrate bitrate);
+  assert (!bitrate = `Bitrate 64000);
+  control (`Set_bitrate (`Bitrate 32000));
+  assert (Opus.Encoder.get_bitrate enc = 32000);
+  control (`Set_bitrate `Bitrate_max);
+  control (`Get_bitrate bitrate);
+  assert (!bitrate = `Bitrate_max);
+  assert (Opus.Encoder.get_bitrate enc > 0);
+  control (`Set_bitrate `Auto);
+  control (`Get_bitrate bitrate);
+  assert (!bitrate = `Auto);
+
+  let lookahead = Opus.Encoder.get_lookahead enc in
+  assert (lookahead > 0);
+  let r = ref 0 in
+  control (`Get_lookahead r);
+  assert (!r = lookahead);
+  r := 0;
+  control (`Get_lookhead r);
+  assert (!r = lookahead);
+
+  Opus.Encoder.set_max_bandwidth enc `Wide_band;
+  assert (Opus.Encoder.get_max_bandwidth enc = `Wide_band);
+  control (`Set_max_bandwidth `Narrow_band);
+  let bandwidth = ref `Full_band in
+  control (`Get_max_bandwidth bandwidth);
+  assert (!bandwidth = `Narrow_band);
+
+  assert (Opus.Encoder.get_application enc = `Audio);
+  control (`Set_application `Voip);
+  let application = ref `Audio in
+  control (`Get_application application);
+  assert (!application = `Voip)
@@ -0,0 +1,14 @@
+(* Copy a file, flipping the bits of the byte in its middle. *)
+
+let () =
+  let src = Sys.argv.(1) in
+  let dst = Sys.argv.(2) in
+  let ic = open_in_bin src in
+  let data = Bytes.create (in_channel_length ic) in
+  really_input ic data 0 (Bytes.length data);
+  close_in ic;
+  let n = Bytes.length data / 2 in
+  Bytes.set data n (Char.chr (Char.code (Bytes.get data n) lxor 0xff));
+  let oc = open_out_bin dst in
+  output_bytes oc data;
+  close_out oc
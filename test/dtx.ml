@@ -0,0 +1,46 @@
+(* Per-frame activity with DTX, see Encoder.activity. *)
+
+let frame_size = 960
+let silence = 50
+let tone_frames = 5
+
+let () =
+  let os = Ogg.Stream.create () in
+  let enc =
+    Opus.Encoder.create ~samplerate:48000 ~channels:1 ~application:`Voip os
+  in
+  Opus.Encoder.set_dtx enc true;
+  let activity =
+    Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout silence
+  in
+  let encode_tone n =
+    let len = n * frame_size in
+    let pcm = Array.init len (fun i -> 0.5 *. sin (float i *. 0.1)) in
+    assert (Opus.Encoder.encode_float ~activity enc [| pcm |] 0 len = len);
+    for i = 0 to n - 1 do
+      assert (Opus.Encoder.frame_emitted activity i);
+      match Opus.Encoder.frame_mode activity i with
+        | `Silk | `Hybrid | `Celt -> ()
+    done;
+    let rec last_page () =
+      let page = Ogg.Stream.flush_page os in
+      try last_page () with Ogg.Not_enough_data -> page
+    in
+    Ogg.Page.granulepos (last_page ())
+  in
+  let start = encode_tone 1 in
+
+  let len = silence * frame_size in
+  assert (
+    Opus.Encoder.encode_float ~activity enc [| Array.make len 0. |] 0 len = len);
+  let suppressed = ref 0 in
+  for i = 0 to silence - 1 do
+    if not (Opus.Encoder.frame_emitted activity i) then (
+      incr suppressed;
+      assert (Opus.Encoder.frame_in_dtx activity i))
+  done;
+  assert (!suppressed > 0);
+
+  (* Suppressed frames still advance the granule position. *)
+  let stop = encode_tone tone_frames in
+  assert (Int64.sub stop start = Int64.of_int ((silence + tone_frames) * frame_size))
@@ -0,0 +1,69 @@
+(* Loudness measurement and gain tags. *)
+
+let samplerate = 48000
+
+let encoder () =
+  Opus.Encoder.create ~samplerate ~channels:2 ~application:`Audio
+    (Ogg.Stream.create ())
+
+(* Loudness of [seconds] of [f] on both channels. *)
+let measure seconds f =
+  let enc = encoder () in
+  Opus.Encoder.enable_loudness enc;
+  let len = seconds * samplerate in
+  let pcm = Array.init len f in
+  ignore (Opus.Encoder.encode_float enc [| pcm; pcm |] 0 len);
+  Opus.Encoder.loudness enc
+
+(* Write packets to an Ogg stream and read them back. *)
+let round_trip packets =
+  let os = Ogg.Stream.create () in
+  let is = Ogg.Stream.create ~serial:(Ogg.Stream.serialno os) () in
+  List.map
+    (fun p ->
+      Ogg.Stream.put_packet os p;
+      Ogg.Stream.put_page is (Ogg.Stream.flush_page os);
+      Ogg.Stream.get_packet is)
+    packets
+
+let () =
+  (* EBU Tech 3341, case 1: 997 Hz sine at -23 dBFS on both channels. *)
+  let amplitude = 10. ** (-23. /. 20.) in
+  let l =
+    measure 20 (fun i ->
+        amplitude
+        *. sin (2. *. Float.pi *. 997. *. float i /. float samplerate))
+  in
+  assert (abs_float (l.integrated +. 23.) <= 0.1);
+  assert (l.range <= 1.);
+  assert (abs_float (l.sample_peak +. 23.) <= 0.1);
+  assert (l.true_peak >= l.sample_peak && l.true_peak <= -22.5);
+  assert (Opus.Loudness.r128_gain l = 0);
+
+  let l = measure 5 (fun _ -> 0.) in
+  assert (l.integrated = neg_infinity);
+  assert (Opus.Loudness.r128_gain l = 0);
+
+  let enc = encoder () in
+  let header = Opus.Encoder.header enc in
+  assert (Opus.Loudness.header_gain header = 0);
+  let gain p = Opus.Loudness.header_gain p in
+  assert (gain (Opus.Loudness.set_header_gain header (-512)) = -512);
+  assert (gain (Opus.Loudness.set_header_gain header 40000) = 32767);
+  assert (gain (Opus.Loudness.set_header_gain header (-40000)) = -32768);
+
+  let tags =
+    Opus.Loudness.set_tags (Opus.Encoder.comments enc)
+      [("TITLE", "a"); ("ARTIST", "b")]
+  in
+  let tags = Opus.Loudness.set_tags tags [("title", "c")] in
+  let tags = Opus.Loudness.set_track_gain tags (-256) in
+  match round_trip [Opus.Loudness.set_header_gain header 256; tags] with
+    | [header; tags] ->
+        let dec = Opus.Decoder.create header tags in
+        let _, comments = Opus.Decoder.comments dec in
+        assert (
+          List.sort compare comments
+          = [("ARTIST", "b"); ("R128_TRACK_GAIN", "-256"); ("title", "c")]);
+        assert (Opus.Loudness.header_gain header = 256)
+    | _ -> assert false
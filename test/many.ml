@@ -0,0 +1,84 @@
+(* Round trip through Encoder.encode_many and Decoder.decode_many. *)
+
+open Bigarray
+
+let handles = 4
+let channels = 2
+let frame_size = 960
+let max_bytes = 4000
+let frames = 10
+
+let () =
+  let encoders =
+    Array.init handles (fun _ ->
+        Opus.Encoder.create ~samplerate:48000 ~channels ~application:`Audio
+          (Ogg.Stream.create ()))
+  in
+  let decoders =
+    Array.map
+      (fun e ->
+        Opus.Decoder.create (Opus.Encoder.header e) (Opus.Encoder.comments e))
+      encoders
+  in
+  let len = frame_size * channels in
+  let pcm = Array1.create float32 c_layout (handles * len) in
+  for i = 0 to Array1.dim pcm - 1 do
+    pcm.{i} <- 0.5 *. sin (float i *. 0.01)
+  done;
+  let out = Array1.create float32 c_layout (handles * len) in
+  let data = Array1.create char c_layout (handles * max_bytes) in
+  let pcm_ofs = Array.init handles (fun i -> i * len) in
+  let pcm_len = Array.make handles frame_size in
+  let data_ofs = Array.init handles (fun i -> i * max_bytes) in
+  let data_len = Array.make handles max_bytes in
+  let decoded = Array.make handles 0 in
+  for _ = 1 to frames do
+    let bytes =
+      Opus.Encoder.encode_many ~threads:2 encoders ~pcm ~pcm_ofs ~data
+        ~data_ofs ~data_len
+    in
+    Array.iter (fun n -> assert (n > 0)) bytes;
+    let samples =
+      Opus.Decoder.decode_many ~threads:2 decoders ~data ~data_ofs
+        ~data_len:bytes ~pcm:out ~pcm_ofs ~pcm_len
+    in
+    Array.iteri (fun i n -> decoded.(i) <- decoded.(i) + n) samples
+  done;
+  Array.iteri
+    (fun i n ->
+      assert (n = (frames * frame_size) - Opus.Decoder.pre_skip decoders.(i)))
+    decoded;
+
+  (* Slices out of bounds. *)
+  let pcm_ofs = Array.copy pcm_ofs in
+  pcm_ofs.(1) <- Array1.dim pcm - 1;
+  let bytes =
+    Opus.Encoder.encode_many encoders ~pcm ~pcm_ofs ~data ~data_ofs ~data_len
+  in
+  assert (bytes.(1) = -1);
+  assert (bytes.(0) > 0 && bytes.(2) > 0 && bytes.(3) > 0);
+  let data_len = Array.copy bytes in
+  data_len.(1) <- 0;
+  data_len.(2) <- Array1.dim data;
+  let samples =
+    Opus.Decoder.decode_many decoders ~data ~data_ofs ~data_len ~pcm:out
+      ~pcm_ofs:(Array.init handles (fun i -> i * len))
+      ~pcm_len
+  in
+  assert (samples.(2) = -1);
+  assert (samples.(0) > 0 && samples.(3) > 0);
+
+  (* Repeated handles with several threads. *)
+  let twice a = [| a.(0); a.(0) |] in
+  let bytes =
+    Opus.Encoder.encode_many ~threads:2 (twice encoders) ~pcm
+      ~pcm_ofs:[| 0; len |] ~data ~data_ofs:[| 0; max_bytes |]
+      ~data_len:[| max_bytes; max_bytes |]
+  in
+  assert (bytes.(0) > 0 && bytes.(1) = -1);
+  let samples =
+    Opus.Decoder.decode_many ~threads:2 (twice decoders) ~data
+      ~data_ofs:[| 0; 0 |] ~data_len:[| bytes.(0); bytes.(0) |] ~pcm:out
+      ~pcm_ofs:[| 0; len |] ~pcm_len:[| frame_size; frame_size |]
+  in
+  assert (samples.(0) > 0 && samples.(1) = -1)
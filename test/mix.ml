@@ -0,0 +1,80 @@
+(* Decoding to a number of channels independent of the packets'. *)
+
+let frame_size = 960
+let len = 20 * frame_size
+
+(* Header, comments and stream of the packets of a [channels] channels
+   stream. *)
+let encode ?(force_mono = false) channels =
+  let os = Ogg.Stream.create () in
+  let enc =
+    Opus.Encoder.create ~samplerate:48000 ~channels ~application:`Audio os
+  in
+  if force_mono then Opus.Encoder.apply_control (`Set_force_channels true) enc;
+  let pcm =
+    Array.init channels (fun c ->
+        Array.init len (fun i -> 0.3 *. sin (float (i * (c + 1)) *. 0.02)))
+  in
+  ignore (Opus.Encoder.encode_float enc pcm 0 len);
+  let is = Ogg.Stream.create ~serial:(Ogg.Stream.serialno os) () in
+  (try
+     while true do
+       Ogg.Stream.put_page is (Ogg.Stream.flush_page os)
+     done
+   with Ogg.Not_enough_data -> ());
+  (Opus.Encoder.header enc, Opus.Encoder.comments enc, is)
+
+let decode ?channels ?mix (header, comments, is) outputs =
+  let dec = Opus.Decoder.create ?channels header comments in
+  Option.iter (Opus.Decoder.set_mix dec) mix;
+  let out = Array.make outputs [||] in
+  let buf = Array.init outputs (fun _ -> Array.make frame_size 0.) in
+  (try
+     while true do
+       let n = Opus.Decoder.decode_float dec is buf 0 frame_size in
+       for o = 0 to outputs - 1 do
+         out.(o) <- Array.append out.(o) (Array.sub buf.(o) 0 n)
+       done
+     done
+   with Ogg.Not_enough_data -> ());
+  assert (Array.length out.(0) = len - Opus.Decoder.pre_skip dec);
+  out
+
+let same a b =
+  let rec f i =
+    i = Array.length a || (abs_float (a.(i) -. b.(i)) < 1e-5 && f (i + 1))
+  in
+  Array.length a = Array.length b && f 0
+
+let () =
+  (* Mono packets in a stereo stream used to raise Invalid_argument. *)
+  let out = decode (encode ~force_mono:true 2) 2 in
+  assert (same out.(0) out.(1));
+
+  (* Mono streams decoded to stereo, by libopus or by the default mix. *)
+  let out = decode ~channels:2 (encode 1) 2 in
+  assert (same out.(0) out.(1));
+  let out = decode (encode 1) 2 in
+  assert (same out.(0) out.(1));
+
+  (* Stereo streams decoded to mono by libopus. *)
+  let out = decode ~channels:1 (encode 2) 2 in
+  assert (same out.(0) out.(1));
+
+  (* Default downmix and custom matrix. *)
+  let stereo = decode (encode 2) 2 in
+  let mono = decode (encode 2) 1 in
+  assert (
+    same mono.(0)
+      (Array.map2 (fun l r -> (l +. r) /. 2.) stereo.(0) stereo.(1)));
+  let mix = [| [| 1.; 0. |]; [| 0.; 1. |]; [| 0.5; -0.5 |] |] in
+  let out = decode ~mix (encode 2) 3 in
+  assert (same out.(0) stereo.(0) && same out.(1) stereo.(1));
+  assert (
+    same out.(2)
+      (Array.map2 (fun l r -> (l -. r) /. 2.) stereo.(0) stereo.(1)));
+
+  (* Buffers must match the matrix. *)
+  match decode ~mix (encode 2) 2 with
+    | _ -> assert false
+    | exception Invalid_argument _ -> ()